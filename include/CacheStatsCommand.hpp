@@ -0,0 +1,14 @@
+#pragma once
+
+#include "SocketCommand.hpp"
+#include "DownloadCache.hpp"
+#include <date/date.h>
+
+class CacheStatsCommand: public SocketCommand {
+public:
+	CacheStatsCommand() {};
+	~CacheStatsCommand() {};
+
+	void execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) override;
+	nlohmann::json schema() override;
+};
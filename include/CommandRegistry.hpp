@@ -0,0 +1,22 @@
+#pragma once
+
+#include "SocketCommand.hpp"
+
+#include <memory>
+#include <string>
+#include <map>
+
+// Every WebSocket command by name, registered and compiled before the first event loop starts
+// Nothing changes after that, so all server threads look commands up without taking a lock
+class CommandRegistry {
+public:
+	static const CommandRegistry &shared();
+
+	// nullptr when there's no command by that name
+	SocketCommand *find(const std::string &name) const;
+
+private:
+	CommandRegistry();
+
+	std::map<std::string, std::unique_ptr<SocketCommand>> commands;
+};
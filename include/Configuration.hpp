@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+class Configuration {
+public:
+	static Configuration &shared();
+
+	// Amount of event loops serving port 9000, one thread each (0 means hardware concurrency)
+	size_t server_threads;
+
+	// Maximum amount of threads the shared parse pool may spin up (0 means hardware concurrency)
+	size_t worker_threads;
+
+	// Amount of decompressed bytes collected before complete stanzas are handed to a parse task
+	size_t parse_batch_bytes;
+
+	// Parse batches allocate from a per-repository arena instead of the heap
+	bool parse_arena;
+
+	// Upper bound for a single decompressed index so a hostile repo can't exhaust memory (0 disables it)
+	size_t max_index_bytes;
+
+	// Where anything that should survive a restart (validators, caches) is kept
+	std::string cache_directory;
+
+	// Sends Cache-Control: no-cache so proxies and CDNs revalidate with the origin
+	bool bypass_proxy_caches;
+
+	// Connection limits of the shared transfer engine, per host and in total
+	size_t max_host_connections;
+	size_t max_total_connections;
+
+	// Amount of repositories indexed at once off the event loop, and how many of those may share a host
+	size_t index_jobs;
+	size_t index_jobs_per_host;
+
+	// Disk budget for raw downloads kept around to answer 304s from (0 disables the cache)
+	size_t download_cache_bytes;
+
+	// Outbound bytes a socket may have queued before result streams park until it drains, and the size of a package result chunk
+	size_t socket_queue_bytes;
+	size_t socket_chunk_bytes;
+
+	// Starting interval of the background refresh (0 disables it), and how far it may adapt either way
+	size_t refresh_interval_seconds;
+	size_t refresh_min_interval_seconds;
+	size_t refresh_max_interval_seconds;
+
+	// Repositories nobody asked for in this long stop being refreshed (0 keeps them forever), and how many are refreshed at most
+	size_t refresh_expiry_seconds;
+	size_t refresh_max_repositories;
+
+	// Mirrors that get metric series of their own, every host seen after that is counted as "other"
+	size_t metrics_max_hosts;
+
+	// Whether spans are recorded from startup (the trace command toggles it later) and how many each thread keeps
+	bool trace_enabled;
+	size_t trace_events;
+
+private:
+	Configuration();
+	size_t read_size(const char *name, size_t fallback);
+	std::string read_string(const char *name, std::string fallback);
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "StanzaScanner.hpp"
+
+#include <memory_resource>
+#include <string_view>
+#include <string>
+#include <vector>
+#include <deque>
+
+struct ControlField {
+	std::string_view key;
+	std::string_view value;
+};
+
+class ControlStanza {
+public:
+	ControlStanza() {};
+	explicit ControlStanza(std::pmr::memory_resource *resource) : fields(resource), owners(resource), storage(resource) {};
+
+	// Views into the parsed buffer, or into our own storage when a value had to be stitched together
+	std::pmr::vector<ControlField> fields;
+
+	std::string_view get(std::string_view key) const;
+	void clear();
+
+private:
+	friend class ControlParser;
+
+	// Indexed the same as fields, nullptr while a value is still a plain view into the buffer
+	std::pmr::vector<std::pmr::string *> owners;
+	std::pmr::deque<std::pmr::string> storage;
+
+	size_t find(std::string_view key) const;
+	void append(size_t index, std::string_view line);
+};
+
+class ControlParser {
+public:
+	// Tokenizes a single stanza (Debian control format) without copying anything it doesn't have to
+	static void parse(std::string_view stanza, ControlStanza &output);
+
+	// Calls back with every stanza in a Packages buffer, split on blank lines
+	template <typename Callback>
+	static void split(std::string_view content, Callback callback) {
+		size_t start;
+		size_t end = 0;
+
+		while ((start = content.find_first_not_of('\n', end)) != std::string_view::npos) {
+			end = StanzaScanner::find_boundary(content, start);
+			callback(content.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start));
+		}
+	}
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <string_view>
+#include <functional>
+#include <stdexcept>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#ifdef CANISTER_ZLIB_NG
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+
+enum class PackagesFormat {
+	Zstd,
+	Xz,
+	Bzip2,
+	Gzip,
+	Plain
+};
+
+// Incremental decompressors that push their output into a sink as soon as it's available
+// write() and finish() throw std::runtime_error when the stream is corrupt or truncated
+class Decompressor {
+public:
+	using Sink = std::function<void(std::string_view)>;
+
+	Decompressor(Sink sink);
+	virtual ~Decompressor() {};
+
+	virtual void write(std::string_view data) = 0;
+	virtual void finish() = 0;
+
+	static std::unique_ptr<Decompressor> create(PackagesFormat format, Sink sink);
+	static std::string extension(PackagesFormat format);
+	static std::string name(PackagesFormat format);
+
+protected:
+	// Hands output to the sink while keeping it under the configured index size
+	void emit(std::string_view data);
+
+private:
+	Sink sink;
+	size_t output_size = 0;
+	size_t max_output_size;
+};
+
+class PlainDecompressor: public Decompressor {
+public:
+	PlainDecompressor(Sink sink) : Decompressor(std::move(sink)) {};
+
+	void write(std::string_view data) override;
+	void finish() override;
+};
+
+class ZstdDecompressor: public Decompressor {
+public:
+	ZstdDecompressor(Sink sink);
+	~ZstdDecompressor();
+
+	void write(std::string_view data) override;
+	void finish() override;
+
+private:
+	ZSTD_DCtx *context;
+	std::vector<char> output_buffer;
+	size_t last_status = 0;
+};
+
+class Bzip2Decompressor: public Decompressor {
+public:
+	Bzip2Decompressor(Sink sink);
+	~Bzip2Decompressor();
+
+	void write(std::string_view data) override;
+	void finish() override;
+
+private:
+	bz_stream stream;
+	std::vector<char> output_buffer;
+	bool finished = false;
+};
+
+// liblzma's .xz decoder, multithreaded on liblzma builds that have lzma_stream_decoder_mt
+class XzDecompressor: public Decompressor {
+public:
+	XzDecompressor(Sink sink);
+	~XzDecompressor();
+
+	void write(std::string_view data) override;
+	void finish() override;
+
+private:
+	lzma_stream stream = LZMA_STREAM_INIT;
+	std::vector<char> output_buffer;
+	bool finished = false;
+
+	void run(lzma_action action);
+};
+
+// Chunked inflate for gzip (and zlib) streams, optionally backed by zlib-ng
+class GzipDecompressor: public Decompressor {
+public:
+	GzipDecompressor(Sink sink);
+	~GzipDecompressor();
+
+	void write(std::string_view data) override;
+	void finish() override;
+
+private:
+#ifdef CANISTER_ZLIB_NG
+	zng_stream stream;
+#else
+	z_stream stream;
+#endif
+
+	std::vector<char> output_buffer;
+	bool finished = false;
+	bool trailing_garbage = false;
+	size_t members = 0;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <unordered_map>
+#include <string_view>
+#include <functional>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <list>
+
+struct DownloadCacheStats {
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t stores = 0;
+	size_t evictions = 0;
+	size_t entries = 0;
+	size_t bytes = 0;
+	size_t budget = 0;
+};
+
+// Raw download bodies kept on disk as content-addressed blobs, with a URL index on top
+// Lets a 304 be answered from our own copy, and keeps disk use under a byte budget by evicting the least recently used
+class DownloadCache {
+public:
+	// Streams a body into a private temporary file, nothing is visible to readers until commit()
+	// The caller already hashes every download, so it hands the SHA-256 over instead of us hashing again
+	class Writer {
+	public:
+		Writer(DownloadCache &cache, std::string url, std::string temporary_path);
+		~Writer();
+
+		void write(std::string_view data);
+		void commit(const std::string &sha256);
+
+	private:
+		DownloadCache &cache;
+		std::string url;
+		std::string temporary_path;
+		std::ofstream file;
+		size_t size = 0;
+		bool committed = false;
+	};
+
+	static DownloadCache &shared();
+
+	// Null when the cache is disabled (a budget of 0)
+	std::unique_ptr<Writer> begin(const std::string &url);
+
+	// Replays a cached body in chunks, false (and a miss) when there's nothing for the URL
+	bool read(const std::string &url, std::function<void(std::string_view)> callback);
+	bool contains(const std::string &url);
+
+	DownloadCacheStats get_stats();
+
+private:
+	DownloadCache();
+
+	struct Entry {
+		std::string blob;
+		size_t size;
+		std::list<std::string>::iterator recent;
+	};
+
+	std::mutex mutex;
+	std::string directory;
+	size_t budget;
+	size_t total_bytes = 0;
+	size_t temporary_count = 0;
+	DownloadCacheStats stats;
+
+	// URLs that share identical content share one blob, counted here so it's only deleted with the last one
+	std::unordered_map<std::string, Entry> entries;
+	std::unordered_map<std::string, size_t> blob_references;
+
+	// Most recently used first
+	std::list<std::string> recent;
+
+	void insert(const std::string &url, const std::string &blob, size_t size);
+	void erase(const std::string &url);
+	void evict();
+	void load();
+	void save();
+	std::string blob_path(const std::string &blob) const;
+};
@@ -1,5 +1,10 @@
+#pragma once
+
 #include "SocketCommand.hpp"
 #include "RepositoryParser.hpp"
+#include "JobExecutor.hpp"
+#include "SearchIndex.hpp"
+#include "RefreshScheduler.hpp"
 #include <date/date.h>
 
 class IndexRepoCommand: public SocketCommand {
@@ -7,6 +12,6 @@ public:
 	IndexRepoCommand() {};
 	~IndexRepoCommand() {};
 
-	void execute(uWS::WebSocket<false, true, std::string> *ws, nlohmann::json payload) override;
+	void execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) override;
 	nlohmann::json schema() override;
 };
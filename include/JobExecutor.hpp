@@ -0,0 +1,53 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include <stop_token>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <map>
+
+// Runs long jobs (repository indexing) away from the uWS event loop
+// Kept apart from ThreadPool on purpose: jobs block on the network and on parse batches running there
+class JobExecutor {
+public:
+	using Job = std::function<void(std::stop_token)>;
+
+	JobExecutor(size_t thread_count, size_t group_limit);
+	~JobExecutor();
+
+	static JobExecutor &shared();
+	static uint64_t next_job_id();
+
+	// Lower priorities run first, equal ones in submission order
+	// Jobs sharing a group (a mirror host) never run more than group_limit at once, an empty group has no limit
+	// Jobs whose token is already stopped by the time they'd be picked are dropped
+	void submit(Job job, std::stop_token stop_token, double priority = 0, std::string group = "");
+
+	size_t get_active_jobs() const;
+	size_t get_queued_jobs();
+
+private:
+	struct QueuedJob {
+		Job job;
+		std::stop_token stop_token;
+		std::string group;
+	};
+
+	// Keyed by priority then sequence, so the first runnable entry is always the right one to pick
+	std::map<std::pair<double, uint64_t>, QueuedJob> queue;
+	std::unordered_map<std::string, size_t> running_groups;
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::atomic<size_t> active_jobs = 0;
+	uint64_t sequence = 0;
+	size_t group_limit;
+	bool stopping = false;
+
+	bool take_job(QueuedJob &queued_job);
+	void run();
+};
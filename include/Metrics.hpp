@@ -0,0 +1,118 @@
+#pragma once
+
+#include <functional>
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <deque>
+#include <map>
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+class Counter {
+public:
+	void add(uint64_t value = 1) {
+		count.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const {
+		return count.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> count = 0;
+};
+
+class Gauge {
+public:
+	void add(int64_t value) {
+		current.fetch_add(value, std::memory_order_relaxed);
+	}
+
+	void set(int64_t value) {
+		current.store(value, std::memory_order_relaxed);
+	}
+
+	int64_t get() const {
+		return current.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> current = 0;
+};
+
+// Fixed exponential buckets (100µs to ~100s) in seconds, the sum is kept in microseconds so it stays an integer
+class Histogram {
+public:
+	static constexpr size_t bucket_count = 21;
+	static const std::array<double, bucket_count> &bounds();
+
+	void observe(double seconds);
+
+	uint64_t get_count() const;
+	double get_sum() const;
+	uint64_t get_bucket(size_t bucket) const;
+
+private:
+	std::array<std::atomic<uint64_t>, bucket_count + 1> buckets = {};
+	std::atomic<uint64_t> sum_microseconds = 0;
+};
+
+// Process-wide registry rendered in the Prometheus text format
+// Looking a series up takes a lock, so hot paths fetch theirs once and keep the reference (series are never removed)
+class Metrics {
+public:
+	static Metrics &shared();
+
+	Counter &counter(const std::string &name, const std::string &help, MetricLabels labels = {});
+	Gauge &gauge(const std::string &name, const std::string &help, MetricLabels labels = {});
+	Histogram &histogram(const std::string &name, const std::string &help, MetricLabels labels = {});
+
+	// Sampled when rendering, for values that already live somewhere else (queue sizes, active jobs)
+	void callback_gauge(const std::string &name, const std::string &help, std::function<double()> callback);
+
+	std::string render();
+
+private:
+	Metrics() {};
+
+	enum class MetricType {
+		Counter,
+		Gauge,
+		Histogram
+	};
+
+	struct Family {
+		MetricType type;
+		std::string help;
+		std::map<std::string, Counter *> counters;
+		std::map<std::string, Gauge *> gauges;
+		std::map<std::string, Histogram *> histograms;
+		std::function<double()> callback;
+	};
+
+	std::mutex mutex;
+	std::map<std::string, Family> families;
+
+	// Deques never move what they hold, so references handed out stay valid
+	std::deque<Counter> counter_storage;
+	std::deque<Gauge> gauge_storage;
+	std::deque<Histogram> histogram_storage;
+
+	Family &family(const std::string &name, const std::string &help, MetricType type);
+	static std::string label_string(const MetricLabels &labels);
+};
+
+// Seconds since construction, for timing a phase without dragging <chrono> everywhere
+class MetricTimer {
+public:
+	MetricTimer();
+	double elapsed() const;
+
+private:
+	int64_t start;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "PackageStore.hpp"
+
+#include <memory_resource>
+#include <string_view>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Takes decompressed Packages data as it arrives and parses complete stanzas on the shared pool
+// Batches are cut on the last blank line we have, so nothing is scanned twice on the writing thread
+// A buffer several batches long is partitioned on blank lines and its parts are parsed in parallel, as views into it
+class PackagePipeline {
+public:
+	PackagePipeline();
+	explicit PackagePipeline(bool arena);
+	~PackagePipeline() {};
+
+	void write(std::string_view data);
+	PackageStore finish();
+
+	size_t bytes_written() const;
+
+	// CPU time the batches spent parsing, summed across pool threads, only complete after finish()
+	double parse_seconds() const;
+
+private:
+	// A parsed batch and the arena its store was allocated from, members go in reverse so the store is gone first
+	// Whatever a batch allocated is dropped in one go once it's merged, nothing is freed piece by piece
+	struct ParsedBatch {
+		std::shared_ptr<std::pmr::memory_resource> upstream;
+		std::pmr::monotonic_buffer_resource arena;
+		PackageStore packages;
+
+		ParsedBatch(std::shared_ptr<std::pmr::memory_resource> upstream, size_t initial_size) : upstream(upstream), arena(initial_size, upstream.get()), packages(&arena) {};
+		ParsedBatch() : packages() {};
+	};
+
+	// Finished arenas hand their blocks back here for the next batch, the pool is released with the last batch
+	std::shared_ptr<std::pmr::memory_resource> pool;
+
+	std::string pending;
+	std::vector<std::future<std::unique_ptr<ParsedBatch>>> batches;
+	size_t batch_bytes;
+	size_t total_bytes = 0;
+	size_t scanned_bytes = 0;
+
+	// Shared with the batches, which can outlive a pipeline that threw before finish()
+	std::shared_ptr<std::atomic<uint64_t>> parse_nanoseconds = std::make_shared<std::atomic<uint64_t>>(0);
+
+	void dispatch(std::string content);
+	void submit(std::shared_ptr<const std::string> buffer, std::string_view chunk);
+};
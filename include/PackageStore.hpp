@@ -0,0 +1,172 @@
+#pragma once
+
+#include "ControlParser.hpp"
+
+#include <memory_resource>
+#include <unordered_map>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <array>
+
+// Fields that show up in (nearly) every stanza get a fixed slot instead of a map entry
+enum class PackageField : uint8_t {
+	Package,
+	Version,
+	Architecture,
+	Name,
+	Description,
+	Section,
+	Maintainer,
+	Author,
+	Depends,
+	PreDepends,
+	Conflicts,
+	Replaces,
+	Provides,
+	Recommends,
+	Suggests,
+	Breaks,
+	Filename,
+	Size,
+	InstalledSize,
+	MD5sum,
+	SHA1,
+	SHA256,
+	Homepage,
+	Depiction,
+	SileoDepiction,
+	Icon,
+	Tag,
+	Priority,
+	Essential,
+	Count
+};
+
+class PackageStore {
+public:
+	static constexpr size_t field_count = static_cast<size_t>(PackageField::Count);
+
+	PackageStore() {};
+	~PackageStore() {};
+
+	// Everything the store allocates comes from the resource, parse batches use a throwaway arena
+	explicit PackageStore(std::pmr::memory_resource *resource) : records(resource), overflow(resource), text(resource), interned_lookup(resource), interned_values(resource) {};
+
+	// The interned strings are viewed in place, so copying would leave dangling views behind
+	PackageStore(const PackageStore &store) = delete;
+	PackageStore &operator=(const PackageStore &store) = delete;
+	// Moving assigns between stores on different resources copy every node, append() is the way to merge those
+	PackageStore(PackageStore &&store) = default;
+	PackageStore &operator=(PackageStore &&store) = default;
+
+	static std::string_view field_name(PackageField field);
+	static bool lookup_field(std::string_view key, PackageField &field);
+	static bool is_interned(PackageField field);
+
+	size_t add(const ControlStanza &stanza);
+	void append(PackageStore &&store);
+	void reserve(size_t packages, size_t bytes);
+
+	size_t size() const;
+	size_t memory_usage() const;
+
+	// Index files hold the store exactly as it sits in memory, so loading one is an mmap and a checksum
+	// Mapped stores are read-only, metadata is an opaque blob stored alongside the packages
+	void save(const std::string &path, std::string_view metadata) const;
+	static PackageStore load(const std::string &path, std::string &metadata);
+
+	bool has(size_t index, PackageField field) const;
+	std::string_view get(size_t index, PackageField field) const;
+	std::string_view get(size_t index, std::string_view key) const;
+
+	// Calls back with (key, value) for every field of a package, well-known fields first
+	template <typename Callback>
+	void for_each_field(size_t index, Callback callback) const {
+		const PackageRecord &record = record_at(index);
+
+		for (size_t field = 0; field < field_count; field++) {
+			if (record.fields[field].offset != absent) {
+				callback(field_name(static_cast<PackageField>(field)), get(index, static_cast<PackageField>(field)));
+			}
+		}
+
+		for (uint32_t offset = 0; offset < record.overflow_count; offset++) {
+			const OverflowField &field = overflow_at(record.overflow_offset + offset);
+			callback(interned_at(field.key), text_view(field.value));
+		}
+	}
+
+private:
+	static constexpr uint32_t absent = UINT32_MAX;
+
+	struct Slot {
+		uint32_t offset = absent;
+		uint32_t length = 0;
+	};
+
+	struct OverflowField {
+		uint32_t key;
+		Slot value;
+	};
+
+	struct PackageRecord {
+		std::array<Slot, field_count> fields;
+		uint32_t overflow_offset = 0;
+		uint32_t overflow_count = 0;
+	};
+
+	std::pmr::vector<PackageRecord> records;
+	std::pmr::vector<OverflowField> overflow;
+
+	// Every value that isn't interned lives back to back in here
+	std::pmr::string text;
+
+	// Repeated values (Section, Architecture, Maintainer, unknown keys) are stored once
+	// unordered_map nodes never move, so the views in interned_values stay valid
+	std::pmr::unordered_map<std::pmr::string, uint32_t> interned_lookup;
+	std::pmr::vector<std::string_view> interned_values;
+
+	// Set when the store is backed by an index file, the vectors above stay empty then
+	struct MappedFile;
+	std::shared_ptr<const MappedFile> mapping;
+	const PackageRecord *mapped_records = nullptr;
+	const OverflowField *mapped_overflow = nullptr;
+	const Slot *mapped_interned = nullptr;
+	const char *mapped_interned_text = nullptr;
+	const char *mapped_text = nullptr;
+	size_t mapped_count = 0;
+	size_t mapped_overflow_count = 0;
+	size_t mapped_interned_count = 0;
+	size_t mapped_text_bytes = 0;
+
+	uint32_t intern(std::string_view value);
+	Slot store_text(std::string_view value);
+	void ensure_mutable() const;
+
+	const PackageRecord &record_at(size_t index) const {
+		return mapping ? mapped_records[index] : records[index];
+	}
+
+	const OverflowField &overflow_at(size_t index) const {
+		return mapping ? mapped_overflow[index] : overflow[index];
+	}
+
+	std::string_view interned_at(uint32_t id) const {
+		if (mapping) {
+			return std::string_view(mapped_interned_text + mapped_interned[id].offset, mapped_interned[id].length);
+		}
+
+		return interned_values[id];
+	}
+
+	std::string_view text_view(Slot slot) const {
+		return std::string_view((mapping ? mapped_text : text.data()) + slot.offset, slot.length);
+	}
+
+	size_t overflow_count() const;
+	size_t interned_count() const;
+	size_t text_bytes() const;
+};
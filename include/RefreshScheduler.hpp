@@ -0,0 +1,94 @@
+#pragma once
+
+#include "RepositoryParser.hpp"
+#include "SearchIndex.hpp"
+
+#include <condition_variable>
+#include <unordered_map>
+#include <stop_token>
+#include <optional>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mutex>
+
+struct RefreshTarget {
+	std::string uri;
+	std::string dist;
+	std::string suite;
+	RepositoryInfo info;
+};
+
+enum class RefreshOutcome {
+	Changed,
+	Unchanged,
+	Failed
+};
+
+// Re-indexes every repository a client ever asked for, without the client having to ask again
+// Repositories that change often are checked more often, ones that never change drift towards the maximum interval
+class RefreshScheduler {
+public:
+	static RefreshScheduler &shared();
+	~RefreshScheduler();
+
+	// Spawns the scheduling thread, does nothing when refreshing is disabled
+	void start();
+
+	// Registers repositories (or updates their slug and ranking), they're about to be indexed so the timer starts over
+	// Past the limit, the repositories asked for least recently are dropped to make room
+	void track(const std::vector<RefreshTarget> &targets);
+
+	// Adapts the interval to what an index found, whoever ran it
+	void report(const std::string &key, RefreshOutcome outcome);
+
+	// What the last client registration said about a repository, for snapshots restored without one
+	std::optional<RepositoryInfo> find_info(const std::string &key);
+	size_t get_tracked_count();
+
+	static RefreshOutcome outcome(const RepositoryParser &parser);
+
+private:
+	RefreshScheduler();
+
+	using Clock = std::chrono::system_clock;
+
+	struct Entry {
+		RefreshTarget target;
+		double interval;
+		Clock::time_point next_refresh;
+		Clock::time_point last_requested;
+		size_t failures = 0;
+		bool running = false;
+	};
+
+	std::mutex mutex;
+	std::condition_variable_any condition;
+	std::unordered_map<std::string, Entry> entries;
+	std::mt19937_64 random;
+	std::stop_source stop_source;
+	std::jthread thread;
+	size_t running_count = 0;
+	bool woken = false;
+
+	std::string path;
+	double default_interval;
+	double min_interval;
+	double max_interval;
+	double expiry;
+	size_t max_entries;
+	size_t max_running;
+
+	void run(std::stop_token stop_token);
+	void refresh(const std::string &key, Entry &entry);
+	std::vector<std::string> expire(Clock::time_point now);
+	std::vector<std::string> evict();
+	void finish(const std::string &key, RefreshOutcome outcome);
+	void adapt(Entry &entry, RefreshOutcome outcome);
+	void schedule(Entry &entry);
+	double jitter(double seconds);
+	void load();
+	void save();
+};
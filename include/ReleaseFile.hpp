@@ -0,0 +1,27 @@
+#pragma once
+
+#include <unordered_map>
+#include <string_view>
+#include <string>
+
+struct ReleaseEntry {
+	std::string path;
+	size_t size = 0;
+	std::string sha256;
+	std::string md5;
+};
+
+// The checksum tables of a Release (or clearsigned InRelease) file, keyed by relative path
+class ReleaseFile {
+public:
+	ReleaseFile() {};
+	~ReleaseFile() {};
+
+	static ReleaseFile parse(std::string_view content);
+
+	const ReleaseEntry *find(std::string_view path) const;
+	bool empty() const;
+
+private:
+	std::unordered_map<std::string, ReleaseEntry> entries;
+};
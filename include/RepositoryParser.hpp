@@ -1,18 +1,34 @@
-#include <curlpp/Options.hpp>
-#include <curlpp/cURLpp.hpp>
-#include <curlpp/Infos.hpp>
-#include <curlpp/Easy.hpp>
-#include <picosha2.h>
-#include <bzlib.h>
-#include <lzma.h>
-#include <zstd.h>
-#include <zlib.h>
-
-#include <fstream>
-#include <sstream>
-#include <thread>
-#include <future>
-#include <regex>
+#pragma once
+
+#include "RepositorySnapshot.hpp"
+#include "PackagePipeline.hpp"
+#include "Decompressor.hpp"
+#include "ValidatorCache.hpp"
+#include "DownloadCache.hpp"
+#include "TransferEngine.hpp"
+#include "ReleaseFile.hpp"
+#include "Sha256.hpp"
+
+#include <functional>
+#include <iostream>
+#include <stop_token>
+#include <optional>
+
+struct PackagesCandidate {
+	PackagesFormat format;
+	size_t size;
+	bool size_known;
+
+	// What the Release file promises for this variant, null when it came from probing
+	const ReleaseEntry *entry = nullptr;
+};
+
+struct TransferResult {
+	long status_code = 0;
+	size_t size = 0;
+	CacheValidators validators;
+	TransferTimings timings;
+};
 
 class RepositoryParser {
 public:
@@ -22,18 +38,68 @@ public:
 	~RepositoryParser() {};
 	int index_repository();
 
+	// Lets a background job abandon the index, whatever was published before stays in place
+	void set_stop_token(std::stop_token stop_token);
+
+	// Nobody's waiting on a background index, so what it changes is held back for the next client instead
+	void set_background(bool background);
+
+	// Widens the delta to everything changed since a client last saw this repository, true when a background index changed it meanwhile
+	bool collect_changes();
+
+	// True when the server confirmed (304) that nothing changed since the last index
+	bool is_unchanged() const;
+
+	// True when no Packages file could be fetched, the previous snapshot (if any) is still the published one
+	bool is_failed() const;
+
+	// What changed since the previous index of this repository, empty when nothing did
+	const PackageDelta &get_delta() const;
+	std::shared_ptr<const RepositorySnapshot> get_snapshot() const;
+
+	// Identifies the repository in the snapshot registry and the search index
+	std::string repository_key() const;
+	static std::string make_key(std::string url, std::string dist, std::string suite);
+
+	// Lowercased host of a repository URL, scheme, credentials and path are dropped so every repository on a mirror shares it
+	static std::string host(std::string url);
+
 private:
 	std::string url, dist, suite;
-	std::string fetch_packages(std::string url);
-	std::map<std::string, std::string> map_package(std::stringstream stream);
+	bool unchanged = false;
+	bool failed = false;
+	bool background = false;
+	int package_count = 0;
+	std::stop_token stop_token;
+
+	std::string source_fingerprint;
+	std::shared_ptr<const RepositorySnapshot> snapshot;
+	PackageDelta delta;
+
+	// Validators of the Release file, held back until its Packages file parsed successfully
+	std::optional<std::pair<std::string, CacheValidators>> release_validators;
+	// Preference order whenever we can't tell which variant is the smallest
+	static constexpr PackagesFormat packages_formats[] = {
+		PackagesFormat::Zstd,
+		PackagesFormat::Xz,
+		PackagesFormat::Bzip2,
+		PackagesFormat::Gzip,
+		PackagesFormat::Plain
+	};
+
+	PackageStore fetch_packages(std::string release_url, std::string packages_path);
+	PackageStore fetch_packages_stream(std::string url, PackagesFormat format, const ReleaseEntry *expected = nullptr);
+	PackageStore commit_packages(PackageStore packages);
+	ReleaseFile fetch_release(std::string url);
+	std::vector<PackagesCandidate> probe_packages(std::string url);
 
 	int index_simple_repository();
 	int index_distribution_repository();
+	int publish_packages(PackageStore packages);
+
+	// Validators are stored under key, the URL itself unless several repositories share the resource
+	std::optional<CacheValidators> find_validators(std::string url, std::string key = "");
 
-	std::string fetch_packages_xz(std::string url);
-	std::string fetch_packages_gzip(std::string url);
-	std::string fetch_packages_zstd(std::string url);
-	std::string fetch_packages_bzip2(std::string url);
-	std::string fetch_packages_normal(std::string url);
-	std::string curl_generic_url(std::string url);
+	TransferResult curl_stream_url(std::string url, std::function<void(std::string_view)> callback, const CacheValidators *validators = nullptr);
+	TransferRequest build_request(std::string url, const CacheValidators *validators = nullptr);
 };
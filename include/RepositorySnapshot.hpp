@@ -0,0 +1,84 @@
+#pragma once
+
+#include "PackageStore.hpp"
+
+#include <unordered_map>
+#include <optional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+struct PackageIdentity {
+	std::string package;
+	std::string version;
+	std::string architecture;
+};
+
+// Changes between two parses of the same repository, indices point into the newer snapshot
+struct PackageDelta {
+	// Set when there was no earlier snapshot, so added holds the complete repository
+	bool full = false;
+
+	std::vector<size_t> added;
+	std::vector<size_t> updated;
+	std::vector<PackageIdentity> removed;
+
+	bool empty() const;
+};
+
+// The last successful parse of a repository, keyed by Package+Version+Architecture
+class RepositorySnapshot {
+public:
+	RepositorySnapshot(PackageStore packages, std::string source_fingerprint);
+	~RepositorySnapshot() {};
+
+	const PackageStore &get_packages() const;
+	const std::string &get_source_fingerprint() const;
+
+	// Increases with every snapshot the process creates, a higher one was parsed later
+	uint64_t get_generation() const;
+
+	PackageDelta diff(const RepositorySnapshot *previous) const;
+
+	// Process-wide registry so every RepositoryParser sees what the last one left behind
+	static std::shared_ptr<const RepositorySnapshot> find(const std::string &repository);
+	// An unseen snapshot came from an index nobody was told about, the one it replaces is kept as a baseline until a client collects it
+	static void publish(const std::string &repository, std::shared_ptr<const RepositorySnapshot> snapshot, bool unseen = false);
+
+	// The oldest snapshot no client was told about yet and the one published now, together so a publish can't slip in between
+	// Nothing when every change was already handed out
+	static std::optional<std::pair<std::shared_ptr<const RepositorySnapshot>, std::shared_ptr<const RepositorySnapshot>>> collect(const std::string &repository);
+	static void forget(const std::string &repository);
+
+	static std::vector<std::pair<std::string, std::shared_ptr<const RepositorySnapshot>>> list();
+
+	// Published snapshots are kept as index files under the cache directory and mapped back in on startup
+	static size_t restore();
+
+private:
+	PackageStore packages;
+	std::string source_fingerprint;
+	uint64_t generation;
+
+	// Identity key -> (index, fingerprint of every field)
+	// Only built on the first diff, a restored snapshot shouldn't walk every package before it can serve
+	mutable std::unordered_map<std::string, std::pair<size_t, uint64_t>> index;
+	mutable std::once_flag index_once;
+
+	const std::unordered_map<std::string, std::pair<size_t, uint64_t>> &get_index() const;
+	static std::string index_path(const std::string &repository);
+
+	static std::string identity_key(const PackageStore &packages, size_t package);
+	static uint64_t fingerprint(const PackageStore &packages, size_t package);
+
+	static std::mutex registry_mutex;
+	static std::unordered_map<std::string, std::shared_ptr<const RepositorySnapshot>> registry;
+
+	// Repository -> what it looked like before the first change no client collected yet, null when it wasn't published then
+	static std::unordered_map<std::string, std::shared_ptr<const RepositorySnapshot>> baselines;
+
+	// One per repository, held while a snapshot is saved and published so the file and the registry always agree
+	static std::unordered_map<std::string, std::shared_ptr<std::mutex>> publish_mutexes;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "SocketCommand.hpp"
+#include "SearchIndex.hpp"
+#include <date/date.h>
+
+class SearchCommand: public SocketCommand {
+public:
+	SearchCommand() {};
+	~SearchCommand() {};
+
+	void execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) override;
+	nlohmann::json schema() override;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "RepositorySnapshot.hpp"
+
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// What index_repo told us about a repository besides its packages
+struct RepositoryInfo {
+	std::string uri;
+	std::string slug;
+	std::vector<std::string> aliases;
+	double ranking = 5;
+};
+
+struct PackageMatch {
+	std::shared_ptr<const RepositorySnapshot> snapshot;
+	std::shared_ptr<const RepositoryInfo> repository;
+	size_t package;
+	double score;
+};
+
+struct RepositoryMatch {
+	std::shared_ptr<const RepositoryInfo> repository;
+	size_t package_count;
+	double score;
+};
+
+struct SearchResults {
+	std::vector<PackageMatch> packages;
+	std::vector<RepositoryMatch> repositories;
+};
+
+// Prefix and trigram lookups over Package and Name, description tokens, and repository slugs/aliases
+// Every repository has its own immutable index, updates swap in a new generation so queries never take a lock
+class SearchIndex {
+public:
+	static SearchIndex &shared();
+
+	// Builds the repository's index off to the side, skipped when neither the snapshot nor the info changed
+	void update(const std::string &repository, std::shared_ptr<const RepositorySnapshot> snapshot, RepositoryInfo info);
+	void remove(const std::string &repository);
+
+	SearchResults search(std::string_view query, size_t limit) const;
+	size_t get_repository_count() const;
+
+private:
+	struct RepositoryIndex;
+	using Generation = std::unordered_map<std::string, std::shared_ptr<const RepositoryIndex>>;
+
+	std::atomic<std::shared_ptr<const Generation>> generation = std::make_shared<const Generation>();
+
+	// Only writers serialize on this, readers just load the current generation
+	std::mutex update_mutex;
+
+	SearchIndex() {};
+	static std::shared_ptr<const RepositoryIndex> build(std::shared_ptr<const RepositorySnapshot> snapshot, std::shared_ptr<const RepositoryInfo> info);
+};
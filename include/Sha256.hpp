@@ -0,0 +1,21 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <string_view>
+#include <string>
+
+// Streaming SHA-256 through OpenSSL's EVP interface, finish() returns lowercase hex like Release files use
+class Sha256 {
+public:
+	Sha256();
+	~Sha256();
+
+	Sha256(const Sha256 &hash) = delete;
+	Sha256 &operator=(const Sha256 &hash) = delete;
+
+	void update(std::string_view data);
+	std::string finish();
+
+private:
+	EVP_MD_CTX *context;
+};
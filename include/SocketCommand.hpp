@@ -1,20 +1,29 @@
+#pragma once
+
 #include <nlohmann/json-schema.hpp>
 #include <nlohmann/json.hpp>
 #include <uWebSockets/App.h>
+#include "SocketSession.hpp"
 #include <string>
 
 class SocketCommand {
 public:
-	virtual void execute(uWS::WebSocket<false, true, std::string> *ws, nlohmann::json payload) = 0;
+	// Runs on the event loop, anything slow should go onto the JobExecutor and answer through the session
+	// Every reply goes out in format, the encoding the request itself came in
+	virtual void execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) = 0;
 	virtual nlohmann::json schema() = 0;
 
-	void validate(nlohmann::json payload) {
+	// Builds the validator once when the command is registered, validate() only runs it
+	void compile() {
 		validator.set_root_schema(schema());
+	}
+
+	void validate(const nlohmann::json &payload) const {
 		validator.validate(payload);
 	}
 
 	SocketCommand() {};
-	~SocketCommand() {};
+	virtual ~SocketCommand() {};
 	SocketCommand(const SocketCommand &command) {
 		name = command.name;
 	}
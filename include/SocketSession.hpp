@@ -0,0 +1,67 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <uWebSockets/App.h>
+#include "WireFormat.hpp"
+#include <stop_token>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+class SocketSession;
+
+// Per-connection user data for uWS, it only carries the session so jobs can outlive the socket safely
+struct SocketData {
+	std::shared_ptr<SocketSession> session;
+};
+
+using SocketConnection = uWS::WebSocket<false, true, SocketData>;
+
+// Lets background jobs talk to a socket without touching it off the event loop
+// Messages queue up here and only reach uWS while its own buffer is small, a closed socket just swallows them
+// Nothing ever waits on a slow client, producers of bulk data check is_backlogged() and park with when_drained()
+class SocketSession: public std::enable_shared_from_this<SocketSession> {
+public:
+	SocketSession(SocketConnection *ws, uWS::Loop *loop);
+	~SocketSession() {};
+
+	// Safe from any thread and never blocks
+	// Encoded in the format of the request being answered, so a client can mix encodings between requests
+	void send(nlohmann::json response, WireFormat format);
+	bool is_closed() const;
+
+	// True while more than socket_queue_bytes wait for the client
+	bool is_backlogged();
+
+	// Runs callback once the queue is below socket_queue_bytes again or the session closed, right away if it already is
+	// It runs on the event loop then, so it should only hand the work back to the JobExecutor
+	void when_drained(std::function<void()> callback);
+
+	std::stop_token get_stop_token() const;
+
+	// Only called from the event loop, flush() again from the drain handler
+	void flush();
+	void close();
+
+private:
+	SocketConnection *ws;
+	uWS::Loop *loop;
+	std::atomic<bool> closed = false;
+	std::stop_source stop_source;
+
+	std::deque<std::pair<std::string, uWS::OpCode>> outbound;
+	std::vector<std::pair<std::function<void()>, std::chrono::steady_clock::time_point>> drain_callbacks;
+	size_t queued_bytes = 0;
+	size_t queue_limit;
+	bool flush_scheduled = false;
+	std::mutex mutex;
+
+	void run_drain_callbacks(std::unique_lock<std::mutex> &lock);
+
+	// Stays well under maxBackpressure so uWS never has to drop a message on us
+	static constexpr unsigned int flush_threshold = 256 * 1024;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+// Finds the blank lines ("\n\n") stanzas are separated by, 32 or 16 bytes per step where the CPU allows it
+// The implementation (AVX2, SSE2 or plain C++) is picked once from what the CPU reports at runtime
+class StanzaScanner {
+public:
+	// Offset of the first blank line at or after from, npos when there is none
+	static size_t find_boundary(std::string_view content, size_t from = 0);
+
+	// Offset of the last blank line, npos when there is none
+	static size_t rfind_boundary(std::string_view content);
+
+	// Cuts content into at most parts views that each end right after a blank line, the last one takes the rest
+	// Every stanza lands whole in exactly one view, so they can be split on separate threads without copying anything
+	static std::vector<std::string_view> partition(std::string_view content, size_t parts);
+
+	static const char *implementation();
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <type_traits>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+class ThreadPool {
+public:
+	ThreadPool(size_t thread_count);
+	~ThreadPool();
+
+	// Process-wide pool shared by every RepositoryParser, sized from Configuration
+	static ThreadPool &shared();
+
+	template <typename Function>
+	auto submit(Function function) -> std::future<std::invoke_result_t<Function>> {
+		using Result = std::invoke_result_t<Function>;
+
+		// std::function needs to be copyable, so the packaged task has to live behind a shared_ptr
+		auto task = std::make_shared<std::packaged_task<Result()>>(std::move(function));
+		std::future<Result> future = task->get_future();
+
+		enqueue([task]() {
+			(*task)();
+		});
+
+		return future;
+	}
+
+	size_t size() const;
+
+private:
+	struct Worker {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_condition;
+	std::atomic<size_t> pending_tasks = 0;
+	std::atomic<size_t> next_worker = 0;
+	bool stopping = false;
+
+	void enqueue(std::function<void()> task);
+	bool pop_task(size_t index, std::function<void()> &task);
+	void run(size_t index);
+};
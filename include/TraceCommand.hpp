@@ -0,0 +1,15 @@
+#pragma once
+
+#include "SocketCommand.hpp"
+#include "JobExecutor.hpp"
+#include "Tracing.hpp"
+#include <date/date.h>
+
+class TraceCommand: public SocketCommand {
+public:
+	TraceCommand() {};
+	~TraceCommand() {};
+
+	void execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) override;
+	nlohmann::json schema() override;
+};
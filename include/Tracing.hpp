@@ -0,0 +1,98 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <string_view>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+
+struct TraceEvent {
+	const char *name = nullptr;
+	std::string detail;
+	int64_t start = 0;
+	int64_t duration = 0;
+	int64_t bytes = -1;
+};
+
+struct TraceDump {
+	std::string path;
+	size_t events = 0;
+};
+
+// Spans of the last few thousand stages per thread, exported as a Chrome trace (chrome://tracing, Perfetto)
+// Every thread writes only to its own ring, so the mutex in there is only ever contended by an export
+class Tracer {
+public:
+	static Tracer &shared();
+
+	bool is_enabled() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void set_enabled(bool enabled);
+
+	// Microseconds since the tracer was created, the clock every span is measured against
+	int64_t now() const;
+	void record(const char *name, std::string_view detail, int64_t start, int64_t end, int64_t bytes);
+
+	// Drains every ring, so the next export only has what happened since this one
+	nlohmann::json export_trace();
+
+	// Writes the export to a file in the cache directory
+	TraceDump dump();
+
+private:
+	Tracer();
+
+	struct Buffer {
+		std::mutex mutex;
+		std::vector<TraceEvent> events;
+		size_t next = 0;
+		bool wrapped = false;
+		size_t thread = 0;
+	};
+
+	std::atomic<bool> enabled = false;
+	int64_t epoch;
+	size_t capacity;
+
+	// Rings outlive their threads, spans from a finished job are still worth exporting
+	std::mutex mutex;
+	std::vector<std::shared_ptr<Buffer>> buffers;
+
+	Buffer &local_buffer();
+};
+
+// Times the enclosing scope, costs a single relaxed load when tracing is off
+// The name must be a string literal, it's kept as a pointer until the export
+class TraceSpan {
+public:
+	TraceSpan(const char *name, std::string_view detail = {}, int64_t bytes = -1) {
+		Tracer &tracer = Tracer::shared();
+		if (tracer.is_enabled()) {
+			this->name = name;
+			this->detail = detail;
+			this->bytes = bytes;
+			start = tracer.now();
+		}
+	}
+
+	~TraceSpan() {
+		if (name != nullptr) {
+			Tracer &tracer = Tracer::shared();
+			tracer.record(name, detail, start, tracer.now(), bytes);
+		}
+	}
+
+	TraceSpan(const TraceSpan &) = delete;
+	TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+	const char *name = nullptr;
+	std::string detail;
+	int64_t start = 0;
+	int64_t bytes = -1;
+};
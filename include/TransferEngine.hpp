@@ -0,0 +1,128 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include <string_view>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#include <curl/curl.h>
+
+struct TransferRequest {
+	std::string url;
+	std::vector<std::string> headers;
+	std::string user_agent;
+
+	// There's no limit on the whole transfer, a big index on a slow mirror takes as long as it takes
+	// Only a connection that can't be made or a transfer that stalls (under low_speed_limit bytes per second for low_speed_time seconds) is given up on
+	// Paused transfers aren't speed checked, so a parser that's behind never gets its own download aborted
+	long connect_timeout = 10;
+	long low_speed_limit = 128;
+	long low_speed_time = 30;
+
+	// HEAD instead of GET, only the status and headers are of interest
+	bool no_body = false;
+};
+
+// Seconds spent in each phase, from curl's own clocks
+// Reused connections skip the lookup and the handshakes, so those phases read 0
+struct TransferTimings {
+	double dns = 0;
+	double connect = 0;
+	double tls = 0;
+	double first_byte = 0;
+	double download = 0;
+	double total = 0;
+};
+
+// One in-flight request on the shared engine, the body is pulled chunk by chunk by whoever submitted it
+class TransferEngine;
+
+class Transfer: public std::enable_shared_from_this<Transfer> {
+public:
+	Transfer(TransferEngine *engine, TransferRequest request) : engine(engine), request(std::move(request)) {};
+	~Transfer() {};
+
+	// Blocks for the next chunk of the body, false once the transfer is over
+	bool read(std::string &chunk);
+
+	// Stops the transfer early, anything still queued is dropped
+	void cancel();
+
+	// Only meaningful once read() returned false
+	long get_status_code();
+	std::string get_error();
+	long long get_content_length();
+	std::string get_header(const std::string &name);
+	TransferTimings get_timings();
+
+private:
+	friend class TransferEngine;
+
+	// Past this much unread body the transfer is paused until the reader catches up
+	static constexpr size_t max_queued_bytes = 4 * 1024 * 1024;
+
+	TransferEngine *engine;
+	TransferRequest request;
+	CURL *handle = nullptr;
+	struct curl_slist *header_list = nullptr;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::string> chunks;
+	size_t queued_bytes = 0;
+	bool paused = false;
+	bool cancelled = false;
+	bool finished = false;
+
+	long status_code = 0;
+	long long content_length = -1;
+	std::string error;
+	TransferTimings timings;
+	std::unordered_map<std::string, std::string> headers;
+
+	static size_t write_callback(char *data, size_t size, size_t count, void *user_data);
+	static size_t header_callback(char *data, size_t size, size_t count, void *user_data);
+};
+
+// A single curl_multi handle shared by every RepositoryParser
+// Connections, TLS sessions and DNS lookups are reused across repositories, with HTTP/2 multiplexing where offered
+class TransferEngine {
+public:
+	static TransferEngine &shared();
+	~TransferEngine();
+
+	std::shared_ptr<Transfer> submit(TransferRequest request);
+
+private:
+	friend class Transfer;
+
+	TransferEngine();
+
+	CURLM *multi;
+	CURLSH *share;
+	std::mutex share_mutexes[CURL_LOCK_DATA_LAST];
+
+	std::thread thread;
+	std::mutex mutex;
+	bool stopping = false;
+
+	std::vector<std::shared_ptr<Transfer>> incoming;
+	std::vector<std::shared_ptr<Transfer>> resumed;
+	std::vector<std::shared_ptr<Transfer>> cancelled;
+	std::unordered_map<CURL *, std::shared_ptr<Transfer>> active;
+
+	void run();
+	void start(std::shared_ptr<Transfer> transfer);
+	void complete(CURL *handle, CURLcode result);
+	void resume(std::shared_ptr<Transfer> transfer);
+	void cancel(std::shared_ptr<Transfer> transfer);
+	void wake(std::shared_ptr<Transfer> transfer, std::vector<std::shared_ptr<Transfer>> &queue);
+
+	static void lock_share(CURL *handle, curl_lock_data data, curl_lock_access access, void *user_data);
+	static void unlock_share(CURL *handle, curl_lock_data data, void *user_data);
+};
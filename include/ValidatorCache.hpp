@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+#include <stop_token>
+#include <optional>
+#include <string>
+#include <thread>
+#include <mutex>
+
+struct CacheValidators {
+	std::string etag;
+	std::string last_modified;
+
+	// What the resource parsed to last time, so a 304 can answer without touching it (-1 when unknown)
+	int package_count = -1;
+};
+
+// ETag/Last-Modified values per URL, persisted in the cache directory so they survive restarts
+// Changes are written out in batches by a thread of its own, fetches never wait on the file
+class ValidatorCache {
+public:
+	static ValidatorCache &shared();
+	~ValidatorCache();
+
+	std::optional<CacheValidators> find(const std::string &url);
+	void store(const std::string &url, CacheValidators validators);
+	void erase(const std::string &url);
+
+private:
+	ValidatorCache();
+
+	std::mutex mutex;
+	std::condition_variable_any condition;
+	std::unordered_map<std::string, CacheValidators> entries;
+	std::string path;
+	bool dirty = false;
+	std::jthread thread;
+
+	void load();
+	void run(std::stop_token stop_token);
+	void save(std::unique_lock<std::mutex> &lock);
+};
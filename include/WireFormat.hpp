@@ -0,0 +1,24 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <uWebSockets/App.h>
+#include <string_view>
+#include <string>
+
+enum class WireFormat {
+	Json,
+	Cbor,
+	MessagePack
+};
+
+// Requests arrive as JSON text frames or as CBOR/MessagePack binary frames, replies go back the same way
+class WireCodec {
+public:
+	// Every request is a map, so a binary frame's first byte is enough to tell the encodings apart
+	static bool detect(std::string_view message, uWS::OpCode opCode, WireFormat &format);
+
+	static nlohmann::json decode(std::string_view message, WireFormat format);
+	static std::string encode(const nlohmann::json &response, WireFormat format);
+	static uWS::OpCode opcode(WireFormat format);
+	static std::string name(WireFormat format);
+};
@@ -0,0 +1,573 @@
+#include "ControlParser.hpp"
+#include "PackageStore.hpp"
+#include "PackagePipeline.hpp"
+#include "StanzaScanner.hpp"
+#include "Decompressor.hpp"
+#include "ThreadPool.hpp"
+#include "../tests/LegacyControlParser.hpp"
+
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <new>
+
+// Benchmarks the Packages hot path (splitting, parsing, storing, decompressing) on generated corpora
+// Corpora only depend on --seed and --packages, so two builds can be compared on identical input
+// Prints one JSON document and exits non-zero if the parser disagrees with the legacy regex parser
+
+struct BenchOptions {
+	size_t packages = 20000;
+	size_t iterations = 5;
+	uint64_t seed = 1;
+	std::string filter;
+	bool legacy = true;
+};
+
+struct Corpus {
+	std::string name;
+	std::string content;
+	size_t packages;
+};
+
+// Keeps the optimizer from dropping work whose result we never look at
+static volatile size_t bench_sink = 0;
+
+// Every C++ allocation in the process (pool threads included) is counted, so each benchmark reports what it cost the heap
+// Codecs allocating through malloc directly aren't seen, their buffers are set up once per stream anyway
+static std::atomic<size_t> allocation_count = 0;
+static std::atomic<size_t> allocation_bytes = 0;
+
+static void *counted_allocation(size_t size, size_t alignment) {
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+
+	size = std::max<size_t>(size, 1);
+	void *pointer = alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size);
+	if (pointer == nullptr) {
+		throw std::bad_alloc();
+	}
+
+	return pointer;
+}
+
+void *operator new(size_t size) {
+	return counted_allocation(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+	return counted_allocation(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *pointer) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept {
+	std::free(pointer);
+}
+
+class CorpusGenerator {
+public:
+	CorpusGenerator(uint64_t seed) : random(seed) {};
+
+	std::string word(size_t min_length, size_t max_length) {
+		static constexpr std::string_view alphabet = "abcdefghijklmnopqrstuvwxyz0123456789";
+		std::string result(range(min_length, max_length), ' ');
+		for (auto &character: result) {
+			character = alphabet[range(0, alphabet.size() - 1)];
+		}
+
+		return result;
+	}
+
+	std::string sentence(size_t min_words, size_t max_words) {
+		std::string result;
+		size_t words = range(min_words, max_words);
+		for (size_t index = 0; index < words; index++) {
+			result.append(index == 0 ? "" : " ").append(word(2, 9));
+		}
+
+		return result;
+	}
+
+	std::string hex(size_t length) {
+		static constexpr std::string_view digits = "0123456789abcdef";
+		std::string result(length, ' ');
+		for (auto &character: result) {
+			character = digits[range(0, 15)];
+		}
+
+		return result;
+	}
+
+	size_t range(size_t min, size_t max) {
+		return std::uniform_int_distribution<size_t>(min, max)(random);
+	}
+
+	bool chance(double probability) {
+		return std::bernoulli_distribution(probability)(random);
+	}
+
+private:
+	std::mt19937_64 random;
+};
+
+static void common_fields(CorpusGenerator &generator, std::string &content, size_t package) {
+	std::string identifier = "com." + generator.word(3, 10) + "." + generator.word(3, 12) + std::to_string(package);
+	content += "Package: " + identifier + "\n";
+	content += "Version: " + std::to_string(generator.range(0, 9)) + "." + std::to_string(generator.range(0, 30)) + "-" + std::to_string(generator.range(1, 9)) + "\n";
+	content += "Architecture: " + std::string(generator.chance(0.8) ? "iphoneos-arm" : "iphoneos-arm64") + "\n";
+	content += "Filename: ./debs/" + identifier + ".deb\n";
+	content += "Size: " + std::to_string(generator.range(1000, 50000000)) + "\n";
+	content += "MD5sum: " + generator.hex(32) + "\n";
+	content += "SHA256: " + generator.hex(64) + "\n";
+}
+
+// Lots of tiny stanzas, what most jailbreak repositories look like
+static Corpus small_corpus(CorpusGenerator &generator, size_t packages) {
+	Corpus corpus = { "small", "", packages };
+	for (size_t package = 0; package < packages; package++) {
+		common_fields(generator, corpus.content, package);
+		corpus.content += "Section: " + std::string(generator.chance(0.5) ? "Tweaks" : "Themes") + "\n";
+		corpus.content += "Description: " + generator.sentence(2, 8) + "\n\n";
+	}
+
+	return corpus;
+}
+
+// Long multiline descriptions and dependency lists, closer to Debian/Procursus style repositories
+static Corpus multiline_corpus(CorpusGenerator &generator, size_t packages) {
+	Corpus corpus = { "multiline", "", packages };
+	for (size_t package = 0; package < packages; package++) {
+		common_fields(generator, corpus.content, package);
+		corpus.content += "Maintainer: " + generator.word(4, 10) + " <" + generator.word(3, 8) + "@example.com>\n";
+
+		std::string depends;
+		size_t dependencies = generator.range(3, 25);
+		for (size_t index = 0; index < dependencies; index++) {
+			depends += (index == 0 ? "" : ", ") + generator.word(3, 12) + " (>= " + std::to_string(generator.range(0, 9)) + ".0)";
+		}
+
+		corpus.content += "Depends: " + depends + "\n";
+		corpus.content += "Description: " + generator.sentence(3, 10) + "\n";
+
+		size_t lines = generator.range(5, 40);
+		for (size_t line = 0; line < lines; line++) {
+			corpus.content += generator.chance(0.1) ? " .\n" : " " + generator.sentence(6, 16) + "\n";
+		}
+
+		corpus.content += "\n";
+	}
+
+	return corpus;
+}
+
+// Custom keys, empty values, duplicates, trailing spaces and stray carriage returns
+static Corpus unusual_corpus(CorpusGenerator &generator, size_t packages) {
+	Corpus corpus = { "unusual", "", packages };
+	for (size_t package = 0; package < packages; package++) {
+		common_fields(generator, corpus.content, package);
+
+		size_t custom_fields = generator.range(2, 12);
+		for (size_t field = 0; field < custom_fields; field++) {
+			corpus.content += "X-" + generator.word(3, 10) + ": " + generator.sentence(1, 6) + "\n";
+		}
+
+		if (generator.chance(0.3)) {
+			corpus.content += "Tag:   \n";
+		}
+
+		if (generator.chance(0.2)) {
+			corpus.content += "Section: Tweaks\nSection: Duplicate\n";
+		}
+
+		if (generator.chance(0.2)) {
+			corpus.content += "Icon: file:///" + generator.word(5, 10) + ".png\r\n";
+		}
+
+		if (generator.chance(0.2)) {
+			corpus.content += "Name: " + generator.sentence(1, 3) + "  \n";
+		}
+
+		corpus.content += "Description: " + generator.sentence(2, 8) + "\n";
+		if (generator.chance(0.3)) {
+			corpus.content += "  continued: with a colon\n";
+		}
+
+		// Some repositories separate stanzas with more than one blank line
+		corpus.content += generator.chance(0.1) ? "\n\n\n" : "\n\n";
+	}
+
+	return corpus;
+}
+
+static std::string compress(const std::string &content, PackagesFormat format) {
+	std::string output;
+
+	switch (format) {
+		case PackagesFormat::Zstd: {
+			output.resize(ZSTD_compressBound(content.size()));
+			size_t size = ZSTD_compress(output.data(), output.size(), content.data(), content.size(), 3);
+			if (ZSTD_isError(size)) {
+				throw std::runtime_error("ZSTD: Compression failed");
+			}
+
+			output.resize(size);
+			break;
+		}
+
+		case PackagesFormat::Xz: {
+			output.resize(lzma_stream_buffer_bound(content.size()));
+			size_t size = 0;
+			if (lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, nullptr, reinterpret_cast<const uint8_t *>(content.data()), content.size(), reinterpret_cast<uint8_t *>(output.data()), &size, output.size()) != LZMA_OK) {
+				throw std::runtime_error("XZ: Compression failed");
+			}
+
+			output.resize(size);
+			break;
+		}
+
+		case PackagesFormat::Bzip2: {
+			unsigned int size = content.size() + content.size() / 100 + 600;
+			output.resize(size);
+			if (BZ2_bzBuffToBuffCompress(output.data(), &size, const_cast<char *>(content.data()), content.size(), 9, 0, 0) != BZ_OK) {
+				throw std::runtime_error("BZip2: Compression failed");
+			}
+
+			output.resize(size);
+			break;
+		}
+
+		case PackagesFormat::Gzip: {
+#ifdef CANISTER_ZLIB_NG
+			zng_stream stream = {};
+			bool ready = zng_deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+			output.resize(ready ? zng_deflateBound(&stream, content.size()) : 0);
+			stream.next_in = reinterpret_cast<const uint8_t *>(content.data());
+			stream.next_out = reinterpret_cast<uint8_t *>(output.data());
+#else
+			z_stream stream = {};
+			bool ready = deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+			output.resize(ready ? deflateBound(&stream, content.size()) : 0);
+			stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(content.data()));
+			stream.next_out = reinterpret_cast<Bytef *>(output.data());
+#endif
+			if (!ready) {
+				throw std::runtime_error("GZip: Compression failed");
+			}
+
+			stream.avail_in = content.size();
+			stream.avail_out = output.size();
+
+#ifdef CANISTER_ZLIB_NG
+			int status = zng_deflate(&stream, Z_FINISH);
+			zng_deflateEnd(&stream);
+#else
+			int status = deflate(&stream, Z_FINISH);
+			deflateEnd(&stream);
+#endif
+			if (status != Z_STREAM_END) {
+				throw std::runtime_error("GZip: Compression failed");
+			}
+
+			output.resize(stream.total_out);
+			break;
+		}
+
+		case PackagesFormat::Plain:
+			output = content;
+			break;
+	}
+
+	return output;
+}
+
+// One warm-up run, then every iteration is timed on its own and the median is what gets reported
+template <typename Function>
+static nlohmann::json measure(const std::string &benchmark, const Corpus &corpus, size_t iterations, Function function) {
+	function();
+
+	std::vector<double> seconds;
+	size_t allocations = allocation_count.load();
+	size_t allocated = allocation_bytes.load();
+	for (size_t iteration = 0; iteration < iterations; iteration++) {
+		auto start = std::chrono::steady_clock::now();
+		function();
+		seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	allocations = (allocation_count.load() - allocations) / iterations;
+	allocated = (allocation_bytes.load() - allocated) / iterations;
+
+	std::sort(seconds.begin(), seconds.end());
+	double median = seconds[seconds.size() / 2];
+	if (seconds.size() % 2 == 0) {
+		median = (seconds[seconds.size() / 2 - 1] + median) / 2;
+	}
+
+	return {
+		{"benchmark", benchmark},
+		{"corpus", corpus.name},
+		{"bytes", corpus.content.size()},
+		{"packages", corpus.packages},
+		{"iterations", iterations},
+		{"median_ms", median * 1000},
+		{"min_ms", seconds.front() * 1000},
+		{"max_ms", seconds.back() * 1000},
+		{"mb_per_s", corpus.content.size() / median / 1000000},
+		{"packages_per_s", corpus.packages / median},
+		{"allocations", allocations},
+		{"allocated_bytes", allocated},
+		{"allocations_per_package", static_cast<double>(allocations) / std::max<size_t>(corpus.packages, 1)}
+	};
+}
+
+// Stanzas in content when it's partitioned first and every part is split on the pool
+static size_t split_partitioned(std::string_view content, size_t parts) {
+	std::vector<std::future<size_t>> counts;
+	for (auto part: StanzaScanner::partition(content, parts)) {
+		counts.push_back(ThreadPool::shared().submit([part]() {
+			size_t stanzas = 0;
+			ControlParser::split(part, [&stanzas](std::string_view) {
+				stanzas++;
+			});
+
+			return stanzas;
+		}));
+	}
+
+	size_t stanzas = 0;
+	for (auto &count: counts) {
+		stanzas += count.get();
+	}
+
+	return stanzas;
+}
+
+static nlohmann::json differential(const Corpus &corpus) {
+	size_t stanzas = 0;
+	size_t mismatches = 0;
+	ControlStanza control_stanza;
+
+	ControlParser::split(corpus.content, [&](std::string_view stanza) {
+		control_stanza.clear();
+		ControlParser::parse(stanza, control_stanza);
+
+		if (stanza_map(control_stanza) != legacy_map_package(std::stringstream(std::string(stanza)))) {
+			mismatches++;
+		}
+
+		stanzas++;
+	});
+
+	// An odd part count so the cuts land in different places than any batch size would put them
+	size_t partitioned_stanzas = split_partitioned(corpus.content, 7);
+	if (partitioned_stanzas != stanzas) {
+		mismatches++;
+	}
+
+	return {
+		{"corpus", corpus.name},
+		{"stanzas", stanzas},
+		{"partitioned_stanzas", partitioned_stanzas},
+		{"mismatches", mismatches}
+	};
+}
+
+static void run_corpus(const Corpus &corpus, const BenchOptions &options, nlohmann::json &results) {
+	auto wanted = [&options](const std::string &benchmark) {
+		return options.filter.empty() || benchmark.find(options.filter) != std::string::npos;
+	};
+
+	if (wanted("split")) {
+		results.push_back(measure("split", corpus, options.iterations, [&corpus]() {
+			size_t stanzas = 0;
+			ControlParser::split(corpus.content, [&stanzas](std::string_view) {
+				stanzas++;
+			});
+
+			bench_sink = stanzas;
+		}));
+	}
+
+	// The whole corpus cut into a few parts per pool thread, like a huge buffer handed to the pipeline in one write
+	if (wanted("split_parallel")) {
+		results.push_back(measure("split_parallel", corpus, options.iterations, [&corpus]() {
+			bench_sink = split_partitioned(corpus.content, ThreadPool::shared().size() * 4);
+		}));
+	}
+
+	if (wanted("parse")) {
+		results.push_back(measure("parse", corpus, options.iterations, [&corpus]() {
+			size_t fields = 0;
+			ControlStanza control_stanza;
+			ControlParser::split(corpus.content, [&](std::string_view stanza) {
+				control_stanza.clear();
+				ControlParser::parse(stanza, control_stanza);
+				fields += control_stanza.fields.size();
+			});
+
+			bench_sink = fields;
+		}));
+	}
+
+	if (wanted("store")) {
+		results.push_back(measure("store", corpus, options.iterations, [&corpus]() {
+			PackageStore packages;
+			ControlStanza control_stanza;
+			ControlParser::split(corpus.content, [&](std::string_view stanza) {
+				control_stanza.clear();
+				ControlParser::parse(stanza, control_stanza);
+				packages.add(control_stanza);
+			});
+
+			bench_sink = packages.size();
+		}));
+	}
+
+	// The same 64 KiB writes the transfer engine hands us, parsed on the shared pool
+	// pipeline_heap is the same thing without the parse arena, the allocation counts show what the arena saves
+	for (bool arena: { true, false }) {
+		std::string benchmark = arena ? "pipeline" : "pipeline_heap";
+		if (!wanted(benchmark)) {
+			continue;
+		}
+
+		results.push_back(measure(benchmark, corpus, options.iterations, [&corpus, arena]() {
+			PackagePipeline pipeline(arena);
+			std::string_view content = corpus.content;
+			for (size_t offset = 0; offset < content.size(); offset += 64 * 1024) {
+				pipeline.write(content.substr(offset, 64 * 1024));
+			}
+
+			bench_sink = pipeline.finish().size();
+		}));
+	}
+
+	if (options.legacy && wanted("legacy_regex")) {
+		results.push_back(measure("legacy_regex", corpus, options.iterations, [&corpus]() {
+			size_t fields = 0;
+			ControlParser::split(corpus.content, [&fields](std::string_view stanza) {
+				fields += legacy_map_package(std::stringstream(std::string(stanza))).size();
+			});
+
+			bench_sink = fields;
+		}));
+	}
+
+	for (auto format: { PackagesFormat::Zstd, PackagesFormat::Xz, PackagesFormat::Bzip2, PackagesFormat::Gzip, PackagesFormat::Plain }) {
+		std::string benchmark = "decompress_" + Decompressor::name(format);
+		std::transform(benchmark.begin(), benchmark.end(), benchmark.begin(), [](unsigned char value) {
+			return std::tolower(value);
+		});
+
+		if (!wanted(benchmark)) {
+			continue;
+		}
+
+		std::string compressed = compress(corpus.content, format);
+		nlohmann::json result = measure(benchmark, corpus, options.iterations, [&compressed, format]() {
+			size_t bytes = 0;
+			std::unique_ptr<Decompressor> decompressor = Decompressor::create(format, [&bytes](std::string_view data) {
+				bytes += data.size();
+			});
+
+			std::string_view input = compressed;
+			for (size_t offset = 0; offset < input.size(); offset += 64 * 1024) {
+				decompressor->write(input.substr(offset, 64 * 1024));
+			}
+
+			decompressor->finish();
+			bench_sink = bytes;
+		});
+
+		result["compressed_bytes"] = compressed.size();
+		results.push_back(result);
+	}
+}
+
+static BenchOptions parse_options(int argc, char **argv) {
+	BenchOptions options;
+
+	for (int index = 1; index < argc; index++) {
+		std::string argument = argv[index];
+		std::string value = index + 1 < argc ? argv[index + 1] : "";
+
+		if (argument == "--packages" && !value.empty()) {
+			options.packages = std::stoull(value);
+			index++;
+		} else if (argument == "--iterations" && !value.empty()) {
+			options.iterations = std::max<size_t>(std::stoull(value), 1);
+			index++;
+		} else if (argument == "--seed" && !value.empty()) {
+			options.seed = std::stoull(value);
+			index++;
+		} else if (argument == "--filter" && !value.empty()) {
+			options.filter = value;
+			index++;
+		} else if (argument == "--no-legacy") {
+			options.legacy = false;
+		} else {
+			throw std::runtime_error("Usage: canister-bench [--packages N] [--iterations N] [--seed N] [--filter NAME] [--no-legacy]");
+		}
+	}
+
+	return options;
+}
+
+int main(int argc, char **argv) {
+	BenchOptions options;
+
+	try {
+		options = parse_options(argc, argv);
+	} catch (std::exception &exc) {
+		std::cerr << exc.what() << std::endl;
+		return 2;
+	}
+
+	CorpusGenerator generator(options.seed);
+	std::vector<Corpus> corpora;
+	corpora.push_back(small_corpus(generator, options.packages));
+	corpora.push_back(multiline_corpus(generator, options.packages / 4));
+	corpora.push_back(unusual_corpus(generator, options.packages));
+
+	nlohmann::json results = nlohmann::json::array();
+	nlohmann::json checks = nlohmann::json::array();
+	size_t mismatches = 0;
+
+	for (const auto &corpus: corpora) {
+		run_corpus(corpus, options, results);
+
+		if (options.legacy) {
+			nlohmann::json check = differential(corpus);
+			mismatches += check["mismatches"].get<size_t>();
+			checks.push_back(check);
+		}
+	}
+
+	nlohmann::json report = {
+		{"seed", options.seed},
+		{"packages", options.packages},
+		{"iterations", options.iterations},
+		{"threads", ThreadPool::shared().size()},
+		{"scanner", StanzaScanner::implementation()},
+		{"results", results},
+		{"differential", checks}
+	};
+
+	std::cout << report.dump(1, '\t') << std::endl;
+	return mismatches == 0 ? 0 : 1;
+}
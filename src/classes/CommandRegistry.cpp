@@ -0,0 +1,31 @@
+#include "CommandRegistry.hpp"
+#include "IndexRepoCommand.hpp"
+#include "SearchCommand.hpp"
+#include "CacheStatsCommand.hpp"
+#include "TraceCommand.hpp"
+
+const CommandRegistry &CommandRegistry::shared() {
+	static CommandRegistry registry;
+	return registry;
+}
+
+CommandRegistry::CommandRegistry() {
+	commands.emplace("index_repo", std::make_unique<IndexRepoCommand>());
+	commands.emplace("search", std::make_unique<SearchCommand>());
+	commands.emplace("cache_stats", std::make_unique<CacheStatsCommand>());
+	commands.emplace("trace", std::make_unique<TraceCommand>());
+
+	// Schemas are compiled up front instead of on every request
+	for (auto &[name, command]: commands) {
+		command->compile();
+	}
+}
+
+SocketCommand *CommandRegistry::find(const std::string &name) const {
+	auto iter = commands.find(name);
+	if (iter == commands.end()) {
+		return nullptr;
+	}
+
+	return iter->second.get();
+}
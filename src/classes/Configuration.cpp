@@ -0,0 +1,53 @@
+#include "Configuration.hpp"
+
+Configuration &Configuration::shared() {
+	static Configuration configuration;
+	return configuration;
+}
+
+Configuration::Configuration() {
+	server_threads = read_size("CANISTER_SERVER_THREADS", 0);
+	worker_threads = read_size("CANISTER_WORKER_THREADS", 0);
+	parse_batch_bytes = read_size("CANISTER_PARSE_BATCH_BYTES", 256 * 1024);
+	parse_arena = read_size("CANISTER_PARSE_ARENA", 1) != 0;
+	max_index_bytes = read_size("CANISTER_MAX_INDEX_BYTES", 1024 * 1024 * 1024);
+	cache_directory = read_string("CANISTER_CACHE_DIR", "/tmp/canister");
+	bypass_proxy_caches = read_size("CANISTER_BYPASS_PROXY_CACHES", 1) != 0;
+	max_host_connections = read_size("CANISTER_MAX_HOST_CONNECTIONS", 6);
+	max_total_connections = read_size("CANISTER_MAX_TOTAL_CONNECTIONS", 64);
+	index_jobs = read_size("CANISTER_INDEX_JOBS", 32);
+	index_jobs_per_host = read_size("CANISTER_INDEX_JOBS_PER_HOST", 2);
+	download_cache_bytes = read_size("CANISTER_DOWNLOAD_CACHE_BYTES", 512 * 1024 * 1024);
+	socket_queue_bytes = read_size("CANISTER_SOCKET_QUEUE_BYTES", 4 * 1024 * 1024);
+	socket_chunk_bytes = read_size("CANISTER_SOCKET_CHUNK_BYTES", 64 * 1024);
+	refresh_interval_seconds = read_size("CANISTER_REFRESH_INTERVAL", 60 * 60);
+	refresh_min_interval_seconds = read_size("CANISTER_REFRESH_MIN_INTERVAL", 5 * 60);
+	refresh_max_interval_seconds = read_size("CANISTER_REFRESH_MAX_INTERVAL", 24 * 60 * 60);
+	refresh_expiry_seconds = read_size("CANISTER_REFRESH_EXPIRY", 30 * 24 * 60 * 60);
+	refresh_max_repositories = read_size("CANISTER_REFRESH_MAX_REPOSITORIES", 10000);
+	metrics_max_hosts = read_size("CANISTER_METRICS_MAX_HOSTS", 100);
+	trace_enabled = read_size("CANISTER_TRACE", 0) != 0;
+	trace_events = read_size("CANISTER_TRACE_EVENTS", 64 * 1024);
+}
+
+size_t Configuration::read_size(const char *name, size_t fallback) {
+	const char *value = std::getenv(name);
+	if (value == nullptr || *value == '\0') {
+		return fallback;
+	}
+
+	try {
+		return std::stoull(value);
+	} catch (std::exception &exc) {
+		return fallback;
+	}
+}
+
+std::string Configuration::read_string(const char *name, std::string fallback) {
+	const char *value = std::getenv(name);
+	if (value == nullptr || *value == '\0') {
+		return fallback;
+	}
+
+	return value;
+}
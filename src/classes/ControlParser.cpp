@@ -0,0 +1,97 @@
+#include "ControlParser.hpp"
+
+std::string_view ControlStanza::get(std::string_view key) const {
+	size_t index = find(key);
+	return index == fields.size() ? std::string_view() : fields[index].value;
+}
+
+void ControlStanza::clear() {
+	fields.clear();
+	owners.clear();
+	storage.clear();
+}
+
+size_t ControlStanza::find(std::string_view key) const {
+	// Stanzas only have a handful of fields, a linear scan beats hashing here
+	for (size_t index = 0; index < fields.size(); index++) {
+		if (fields[index].key == key) {
+			return index;
+		}
+	}
+
+	return fields.size();
+}
+
+void ControlStanza::append(size_t index, std::string_view line) {
+	ControlField &field = fields[index];
+
+	// If the line directly follows the value in the buffer, we can just widen the view over it
+	if (owners[index] == nullptr && field.value.data() != nullptr && field.value.data() + field.value.size() + 1 == line.data()) {
+		field.value = std::string_view(field.value.data(), line.data() + line.size() - field.value.data());
+		return;
+	}
+
+	if (owners[index] == nullptr) {
+		owners[index] = &storage.emplace_back(field.value);
+	}
+
+	owners[index]->append("\n");
+	owners[index]->append(line);
+	field.value = *owners[index];
+}
+
+void ControlParser::parse(std::string_view stanza, ControlStanza &output) {
+	size_t previous_index = std::string_view::npos;
+	size_t position = 0;
+
+	while (position < stanza.size()) {
+		size_t line_end = stanza.find('\n', position);
+		if (line_end == std::string_view::npos) {
+			line_end = stanza.size();
+		}
+
+		std::string_view line = stanza.substr(position, line_end - position);
+		position = line_end + 1;
+
+		if (line.empty()) {
+			continue;
+		}
+
+		// A field is "Key: Value", where the key stops at the first ": "
+		// Lines with a carriage return never counted as fields, so keep that behaviour
+		size_t separator = line.find(": ");
+		if (separator != std::string_view::npos && line.find('\r') == std::string_view::npos) {
+			std::string_view key = line.substr(0, separator);
+			size_t index = output.find(key);
+
+			// Duplicate keys keep their first value, but still receive the continuation lines that follow
+			if (index == output.fields.size()) {
+				output.fields.push_back({ key, line.substr(separator + 2) });
+				output.owners.push_back(nullptr);
+			}
+
+			previous_index = index;
+			continue;
+		}
+
+		// There's a chance instead of multiline, some idiot just gave a key without value
+		// Trim the string incase there may be a space after the colon
+		size_t trim_end = line.find_last_not_of(' ');
+		line = trim_end == std::string_view::npos ? std::string_view() : line.substr(0, trim_end + 1);
+
+		if (line.ends_with(':')) {
+			continue;
+		}
+
+		// Continuation lines before any key end up under an empty key
+		if (previous_index == std::string_view::npos) {
+			previous_index = output.find(std::string_view());
+			if (previous_index == output.fields.size()) {
+				output.fields.push_back({ std::string_view(), std::string_view() });
+				output.owners.push_back(nullptr);
+			}
+		}
+
+		output.append(previous_index, line);
+	}
+}
@@ -0,0 +1,338 @@
+#include "Decompressor.hpp"
+#include "Configuration.hpp"
+#include "ThreadPool.hpp"
+
+// zlib-ng's native API is the zlib API with a prefix, so we only have to swap the names
+#ifdef CANISTER_ZLIB_NG
+#define CANISTER_INFLATE_INIT2 zng_inflateInit2
+#define CANISTER_INFLATE_RESET zng_inflateReset
+#define CANISTER_INFLATE_END zng_inflateEnd
+#define CANISTER_INFLATE zng_inflate
+
+// zng_stream takes plain uint8_t buffers, and its input is already const
+#define CANISTER_INFLATE_INPUT(data) reinterpret_cast<const uint8_t *>(data)
+#define CANISTER_INFLATE_OUTPUT(data) reinterpret_cast<uint8_t *>(data)
+#else
+#define CANISTER_INFLATE_INIT2 inflateInit2
+#define CANISTER_INFLATE_RESET inflateReset
+#define CANISTER_INFLATE_END inflateEnd
+#define CANISTER_INFLATE inflate
+
+// Because of zLIB's weird pointer magic, we need to reinterpret this as a pointer first
+#define CANISTER_INFLATE_INPUT(data) reinterpret_cast<Bytef *>(const_cast<char *>(data))
+#define CANISTER_INFLATE_OUTPUT(data) reinterpret_cast<Bytef *>(data)
+#endif
+
+Decompressor::Decompressor(Sink sink) : sink(std::move(sink)) {
+	max_output_size = Configuration::shared().max_index_bytes;
+}
+
+void Decompressor::emit(std::string_view data) {
+	if (data.empty()) {
+		return;
+	}
+
+	output_size += data.size();
+	if (max_output_size != 0 && output_size > max_output_size) {
+		throw std::runtime_error("Decompressed index exceeds " + std::to_string(max_output_size) + " bytes");
+	}
+
+	sink(data);
+}
+
+std::unique_ptr<Decompressor> Decompressor::create(PackagesFormat format, Sink sink) {
+	switch (format) {
+		case PackagesFormat::Zstd:
+			return std::make_unique<ZstdDecompressor>(std::move(sink));
+		case PackagesFormat::Xz:
+			return std::make_unique<XzDecompressor>(std::move(sink));
+		case PackagesFormat::Bzip2:
+			return std::make_unique<Bzip2Decompressor>(std::move(sink));
+		case PackagesFormat::Gzip:
+			return std::make_unique<GzipDecompressor>(std::move(sink));
+		case PackagesFormat::Plain:
+			return std::make_unique<PlainDecompressor>(std::move(sink));
+		default:
+			throw std::runtime_error(name(format) + ": No decompressor available");
+	}
+}
+
+std::string Decompressor::extension(PackagesFormat format) {
+	switch (format) {
+		case PackagesFormat::Zstd:
+			return ".zst";
+		case PackagesFormat::Xz:
+			return ".xz";
+		case PackagesFormat::Bzip2:
+			return ".bz2";
+		case PackagesFormat::Gzip:
+			return ".gz";
+		default:
+			return "";
+	}
+}
+
+std::string Decompressor::name(PackagesFormat format) {
+	switch (format) {
+		case PackagesFormat::Zstd:
+			return "ZSTD";
+		case PackagesFormat::Xz:
+			return "XZ";
+		case PackagesFormat::Bzip2:
+			return "BZip2";
+		case PackagesFormat::Gzip:
+			return "GZip";
+		default:
+			return "Normal";
+	}
+}
+
+void PlainDecompressor::write(std::string_view data) {
+	emit(data);
+}
+
+void PlainDecompressor::finish() {
+}
+
+ZstdDecompressor::ZstdDecompressor(Sink sink) : Decompressor(std::move(sink)) {
+	context = ZSTD_createDCtx();
+	if (context == NULL) {
+		throw std::runtime_error("Failed to create ZSTD Dictionary Context");
+	}
+
+	// Streams don't require a set size, so we use ZSTD's recommended size
+	output_buffer.resize(ZSTD_DStreamOutSize());
+}
+
+ZstdDecompressor::~ZstdDecompressor() {
+	ZSTD_freeDCtx(context);
+}
+
+void ZstdDecompressor::write(std::string_view data) {
+	ZSTD_inBuffer input = {
+		data.data(),
+		data.size(),
+		0
+	};
+
+	while (input.pos < input.size) {
+		ZSTD_outBuffer output = {
+			output_buffer.data(),
+			output_buffer.size(),
+			0
+		};
+
+		size_t const status = ZSTD_decompressStream(context, &output, &input);
+		if (ZSTD_isError(status)) {
+			throw std::runtime_error(std::string("ZSTD Decompression error - ") + ZSTD_getErrorName(status));
+		}
+
+		emit(std::string_view(output_buffer.data(), output.pos));
+		last_status = status;
+	}
+}
+
+void ZstdDecompressor::finish() {
+	// If the last status was not okay that means decompression failed somewhere
+	if (last_status != 0) {
+		throw std::runtime_error("ZSTD EOF before end of stream");
+	}
+}
+
+Bzip2Decompressor::Bzip2Decompressor(Sink sink) : Decompressor(std::move(sink)) {
+	stream.bzalloc = NULL;
+	stream.bzfree = NULL;
+	stream.opaque = NULL;
+
+	if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+		throw std::runtime_error("Failed to initialize BZip2 decompression");
+	}
+
+	output_buffer.resize(64 * 1024);
+}
+
+Bzip2Decompressor::~Bzip2Decompressor() {
+	BZ2_bzDecompressEnd(&stream);
+}
+
+void Bzip2Decompressor::write(std::string_view data) {
+	// Anything trailing the end of the stream is ignored, same as BZ2_bzRead did
+	if (finished) {
+		return;
+	}
+
+	stream.next_in = const_cast<char *>(data.data());
+	stream.avail_in = data.size();
+
+	// A full output buffer means bzip2 may still be holding on to more data for us
+	do {
+		stream.next_out = output_buffer.data();
+		stream.avail_out = output_buffer.size();
+
+		int status = BZ2_bzDecompress(&stream);
+		if (status != BZ_OK && status != BZ_STREAM_END) {
+			throw std::runtime_error("BZip2 Decompression error - " + std::to_string(status));
+		}
+
+		emit(std::string_view(output_buffer.data(), output_buffer.size() - stream.avail_out));
+		finished = status == BZ_STREAM_END;
+	} while ((stream.avail_in > 0 || stream.avail_out == 0) && !finished);
+}
+
+void Bzip2Decompressor::finish() {
+	if (!finished) {
+		throw std::runtime_error("BZip2 EOF before end of stream");
+	}
+}
+
+XzDecompressor::XzDecompressor(Sink sink) : Decompressor(std::move(sink)) {
+	lzma_ret status;
+
+// lzma_stream_decoder_mt became stable in liblzma 5.4.0
+#if LZMA_VERSION >= 50040002
+	lzma_mt options = {};
+	options.flags = LZMA_CONCATENATED;
+	options.threads = ThreadPool::shared().size();
+	options.timeout = 0;
+
+	// Past a quarter of RAM the decoder drops back to a single thread instead of failing
+	options.memlimit_threading = lzma_physmem() / 4;
+	options.memlimit_stop = UINT64_MAX;
+
+	status = lzma_stream_decoder_mt(&stream, &options);
+#else
+	status = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+
+	if (status != LZMA_OK) {
+		throw std::runtime_error("Failed to initialize XZ decoder - " + std::to_string(status));
+	}
+
+	output_buffer.resize(128 * 1024);
+}
+
+XzDecompressor::~XzDecompressor() {
+	lzma_end(&stream);
+}
+
+void XzDecompressor::write(std::string_view data) {
+	if (data.empty() || finished) {
+		return;
+	}
+
+	stream.next_in = reinterpret_cast<const uint8_t *>(data.data());
+	stream.avail_in = data.size();
+	run(LZMA_RUN);
+}
+
+void XzDecompressor::finish() {
+	// LZMA_CONCATENATED only reports the end once it knows no other stream follows
+	if (!finished) {
+		stream.next_in = NULL;
+		stream.avail_in = 0;
+		run(LZMA_FINISH);
+	}
+
+	if (!finished) {
+		throw std::runtime_error("XZ EOF before end of stream");
+	}
+}
+
+void XzDecompressor::run(lzma_action action) {
+	do {
+		stream.next_out = reinterpret_cast<uint8_t *>(output_buffer.data());
+		stream.avail_out = output_buffer.size();
+
+		lzma_ret status = lzma_code(&stream, action);
+		if (status != LZMA_OK && status != LZMA_STREAM_END) {
+			// LZMA_BUF_ERROR on finish means the input just stopped early
+			if (status == LZMA_BUF_ERROR && action == LZMA_FINISH) {
+				return;
+			}
+
+			throw std::runtime_error("XZ Decompression error - " + std::to_string(status));
+		}
+
+		emit(std::string_view(output_buffer.data(), output_buffer.size() - stream.avail_out));
+
+		if (status == LZMA_STREAM_END) {
+			finished = true;
+			return;
+		}
+	} while (stream.avail_in > 0 || stream.avail_out == 0 || action == LZMA_FINISH);
+}
+
+GzipDecompressor::GzipDecompressor(Sink sink) : Decompressor(std::move(sink)) {
+	// zLIB why do you feel a need
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = Z_NULL;
+	stream.avail_in = 0;
+
+	// windowBits 15
+	// ENABLE_ZLIB_GZIP 32
+	if (CANISTER_INFLATE_INIT2(&stream, 15 | 32) != Z_OK) {
+		throw std::runtime_error("GZip failed to initialize zLIB inflate");
+	}
+
+	// One buffer for the whole stream, every inflate call drains it into the sink
+	output_buffer.resize(128 * 1024);
+}
+
+GzipDecompressor::~GzipDecompressor() {
+	CANISTER_INFLATE_END(&stream);
+}
+
+void GzipDecompressor::write(std::string_view data) {
+	if (data.empty() || trailing_garbage) {
+		return;
+	}
+
+	stream.next_in = CANISTER_INFLATE_INPUT(data.data());
+	stream.avail_in = data.size();
+
+	do {
+		// Some servers concatenate gzip members, each one starts a fresh stream
+		if (finished) {
+			if (CANISTER_INFLATE_RESET(&stream) != Z_OK) {
+				throw std::runtime_error("GZip failed to reset zLIB inflate");
+			}
+
+			finished = false;
+		}
+
+		stream.next_out = CANISTER_INFLATE_OUTPUT(output_buffer.data());
+		stream.avail_out = output_buffer.size();
+
+		int status = CANISTER_INFLATE(&stream, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+			// Padding after a complete member isn't another member, gzip(1) ignores it too
+			if (members > 0 && stream.total_out == 0) {
+				trailing_garbage = true;
+				finished = true;
+				return;
+			}
+
+			throw std::runtime_error(std::string("GZip inflate error: zLIB - ") + (stream.msg ? stream.msg : std::to_string(status)));
+		}
+
+		emit(std::string_view(output_buffer.data(), output_buffer.size() - stream.avail_out));
+
+		if (status == Z_STREAM_END) {
+			finished = true;
+			members++;
+		}
+
+		// Z_BUF_ERROR only means zLIB needs more input than this chunk had
+		if (status == Z_BUF_ERROR) {
+			break;
+		}
+	} while (stream.avail_in > 0 || (stream.avail_out == 0 && !finished));
+}
+
+void GzipDecompressor::finish() {
+	if (!finished) {
+		throw std::runtime_error("GZip EOF before end of stream");
+	}
+}
@@ -0,0 +1,256 @@
+#include "DownloadCache.hpp"
+#include "Configuration.hpp"
+
+#include <filesystem>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+
+DownloadCache::Writer::Writer(DownloadCache &cache, std::string url, std::string temporary_path) : cache(cache) {
+	this->url = url;
+	this->temporary_path = temporary_path;
+	file.open(temporary_path, std::ios::binary | std::ios::trunc);
+}
+
+DownloadCache::Writer::~Writer() {
+	// Abandoned downloads (errors, 304s, cancelled jobs) never leave anything behind
+	if (!committed) {
+		file.close();
+		std::error_code error;
+		std::filesystem::remove(temporary_path, error);
+	}
+}
+
+void DownloadCache::Writer::write(std::string_view data) {
+	file.write(data.data(), data.size());
+	size += data.size();
+}
+
+void DownloadCache::Writer::commit(const std::string &sha256) {
+	file.close();
+	if (!file || size == 0) {
+		return;
+	}
+
+	const std::string &blob = sha256;
+	std::lock_guard<std::mutex> lock(cache.mutex);
+
+	try {
+		// Identical content already has a blob, the rename is atomic so readers see all of it or none of it
+		std::string path = cache.blob_path(blob);
+		if (cache.blob_references.find(blob) == cache.blob_references.end()) {
+			std::filesystem::rename(temporary_path, path);
+			committed = true;
+		}
+
+		cache.insert(url, blob, size);
+		cache.stats.stores++;
+		cache.evict();
+		cache.save();
+	} catch (std::exception &exc) {
+		std::cout << url << ": Failed to cache download - " << exc.what() << std::endl;
+	}
+}
+
+DownloadCache &DownloadCache::shared() {
+	static DownloadCache cache;
+	return cache;
+}
+
+DownloadCache::DownloadCache() {
+	directory = Configuration::shared().cache_directory + "/downloads";
+	budget = Configuration::shared().download_cache_bytes;
+	stats.budget = budget;
+
+	if (budget > 0) {
+		load();
+	}
+}
+
+std::unique_ptr<DownloadCache::Writer> DownloadCache::begin(const std::string &url) {
+	if (budget == 0) {
+		return nullptr;
+	}
+
+	std::string temporary_path;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		// Unique per download, so two parsers fetching the same URL never write the same file
+		temporary_path = directory + "/.tmp-" + std::to_string(getpid()) + "-" + std::to_string(temporary_count++);
+	}
+
+	return std::make_unique<Writer>(*this, url, temporary_path);
+}
+
+bool DownloadCache::read(const std::string &url, std::function<void(std::string_view)> callback) {
+	std::ifstream file;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = entries.find(url);
+		if (iter == entries.end()) {
+			stats.misses++;
+			return false;
+		}
+
+		// Opened under the lock, an eviction after this point only unlinks the name and we keep reading
+		file.open(blob_path(iter->second.blob), std::ios::binary);
+		if (!file.is_open()) {
+			stats.misses++;
+			erase(url);
+			save();
+			return false;
+		}
+
+		recent.splice(recent.begin(), recent, iter->second.recent);
+		stats.hits++;
+	}
+
+	std::string buffer(64 * 1024, '\0');
+	while (file) {
+		file.read(buffer.data(), buffer.size());
+		if (file.gcount() > 0) {
+			callback(std::string_view(buffer.data(), file.gcount()));
+		}
+	}
+
+	return true;
+}
+
+bool DownloadCache::contains(const std::string &url) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return entries.find(url) != entries.end();
+}
+
+DownloadCacheStats DownloadCache::get_stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	DownloadCacheStats current = stats;
+	current.entries = entries.size();
+	current.bytes = total_bytes;
+	return current;
+}
+
+void DownloadCache::insert(const std::string &url, const std::string &blob, size_t size) {
+	// Referenced before the old entry goes, re-downloading identical content must not delete its own blob
+	if (blob_references[blob]++ == 0) {
+		total_bytes += size;
+	}
+
+	erase(url);
+
+	recent.push_front(url);
+	entries[url] = { blob, size, recent.begin() };
+}
+
+void DownloadCache::erase(const std::string &url) {
+	auto iter = entries.find(url);
+	if (iter == entries.end()) {
+		return;
+	}
+
+	const Entry &entry = iter->second;
+	auto references = blob_references.find(entry.blob);
+	if (references != blob_references.end() && --references->second == 0) {
+		blob_references.erase(references);
+		total_bytes -= std::min(total_bytes, entry.size);
+
+		std::error_code error;
+		std::filesystem::remove(blob_path(entry.blob), error);
+	}
+
+	recent.erase(entry.recent);
+	entries.erase(iter);
+}
+
+void DownloadCache::evict() {
+	// The newest entry always stays, even when it alone is over budget
+	while (total_bytes > budget && entries.size() > 1) {
+		erase(recent.back());
+		stats.evictions++;
+	}
+}
+
+void DownloadCache::load() {
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+
+	// Leftovers from downloads that were still running when we went down
+	for (const auto &file: std::filesystem::directory_iterator(directory, error)) {
+		if (file.path().filename().string().starts_with(".tmp-")) {
+			std::filesystem::remove(file.path(), error);
+		}
+	}
+
+	std::ifstream file(directory + "/index");
+	if (!file.is_open()) {
+		return;
+	}
+
+	// One entry per line, most recently used first: url, blob and size separated by tabs
+	std::vector<std::pair<std::string, std::pair<std::string, size_t>>> loaded;
+	std::string line;
+	while (std::getline(file, line)) {
+		std::stringstream stream(line);
+		std::string url, blob, size;
+
+		if (!std::getline(stream, url, '\t') || !std::getline(stream, blob, '\t') || !std::getline(stream, size, '\t')) {
+			continue;
+		}
+
+		// The blob could have been removed by hand, an index entry without it is worthless
+		if (!std::filesystem::exists(blob_path(blob), error)) {
+			continue;
+		}
+
+		try {
+			loaded.push_back({ url, { blob, std::stoull(size) } });
+		} catch (std::exception &exc) {
+			continue;
+		}
+	}
+
+	// Inserting oldest first leaves the list in the order it was saved in
+	for (auto iter = loaded.rbegin(); iter != loaded.rend(); ++iter) {
+		insert(iter->first, iter->second.first, iter->second.second);
+	}
+
+	// Blobs nothing points at anymore only take up space
+	for (const auto &blob: std::filesystem::directory_iterator(directory, error)) {
+		std::string name = blob.path().filename().string();
+		if (name != "index" && blob_references.find(name) == blob_references.end()) {
+			std::filesystem::remove(blob.path(), error);
+		}
+	}
+
+	evict();
+}
+
+void DownloadCache::save() {
+	try {
+		// Written next to the real index and renamed over it, so a crash never leaves half of it
+		std::string path = directory + "/index";
+		std::string temporary_path = path + ".tmp";
+		std::ofstream file(temporary_path, std::ios::trunc);
+
+		for (const auto &url: recent) {
+			if (url.find('\t') != std::string::npos || url.find('\n') != std::string::npos) {
+				continue;
+			}
+
+			const Entry &entry = entries[url];
+			file << url << "\t" << entry.blob << "\t" << entry.size << "\n";
+		}
+
+		file.close();
+		std::filesystem::rename(temporary_path, path);
+	} catch (std::exception &exc) {
+		std::cout << directory << ": Failed to save download index - " << exc.what() << std::endl;
+	}
+}
+
+std::string DownloadCache::blob_path(const std::string &blob) const {
+	return directory + "/" + blob;
+}
@@ -0,0 +1,126 @@
+#include "JobExecutor.hpp"
+#include "Configuration.hpp"
+
+#include <iostream>
+
+JobExecutor::JobExecutor(size_t thread_count, size_t group_limit) {
+	this->group_limit = group_limit == 0 ? 1 : group_limit;
+
+	if (thread_count == 0) {
+		thread_count = 1;
+	}
+
+	for (size_t index = 0; index < thread_count; index++) {
+		threads.emplace_back(&JobExecutor::run, this);
+	}
+}
+
+JobExecutor::~JobExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	condition.notify_all();
+	for (auto &thread: threads) {
+		thread.join();
+	}
+}
+
+JobExecutor &JobExecutor::shared() {
+	static JobExecutor executor(Configuration::shared().index_jobs, Configuration::shared().index_jobs_per_host);
+	return executor;
+}
+
+uint64_t JobExecutor::next_job_id() {
+	static std::atomic<uint64_t> job_id = 0;
+	return ++job_id;
+}
+
+void JobExecutor::submit(Job job, std::stop_token stop_token, double priority, std::string group) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.emplace(std::make_pair(priority, sequence++), QueuedJob{ std::move(job), stop_token, std::move(group) });
+	}
+
+	condition.notify_one();
+}
+
+size_t JobExecutor::get_active_jobs() const {
+	return active_jobs.load(std::memory_order_relaxed);
+}
+
+size_t JobExecutor::get_queued_jobs() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.size();
+}
+
+// Called with the mutex held, skips past anything whose host is already saturated
+bool JobExecutor::take_job(QueuedJob &queued_job) {
+	for (auto iter = queue.begin(); iter != queue.end();) {
+		// The client that asked for this already went away
+		if (iter->second.stop_token.stop_requested()) {
+			iter = queue.erase(iter);
+			continue;
+		}
+
+		const std::string &group = iter->second.group;
+		auto running = running_groups.find(group);
+		if (running != running_groups.end() && running->second >= group_limit) {
+			++iter;
+			continue;
+		}
+
+		if (!group.empty()) {
+			running_groups[group]++;
+		}
+
+		queued_job = std::move(iter->second);
+		queue.erase(iter);
+		return true;
+	}
+
+	return false;
+}
+
+void JobExecutor::run() {
+	while (true) {
+		QueuedJob queued_job;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this, &queued_job]() {
+				return stopping || take_job(queued_job);
+			});
+
+			if (stopping) {
+				return;
+			}
+		}
+
+		active_jobs.fetch_add(1, std::memory_order_relaxed);
+
+		// Jobs report their own failures to whoever asked, this only keeps the worker alive
+		try {
+			queued_job.job(queued_job.stop_token);
+		} catch (std::exception &exc) {
+			std::cout << exc.what() << std::endl;
+		} catch (...) {
+			std::cout << "error\n";
+		}
+
+		active_jobs.fetch_sub(1, std::memory_order_relaxed);
+
+		if (!queued_job.group.empty()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--running_groups[queued_job.group] == 0) {
+					running_groups.erase(queued_job.group);
+				}
+			}
+
+			// A freed host slot can unblock jobs further down the queue, so everyone gets to look
+			condition.notify_all();
+		}
+	}
+}
@@ -0,0 +1,203 @@
+#include "Metrics.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+
+const std::array<double, Histogram::bucket_count> &Histogram::bounds() {
+	// Roughly doubling from 100µs, wide enough for both a send and a slow mirror
+	static const std::array<double, bucket_count> values = {
+		0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+		0.25, 0.5, 1, 2.5, 5, 10, 15, 20, 30, 60, 120
+	};
+
+	return values;
+}
+
+void Histogram::observe(double seconds) {
+	seconds = std::max(seconds, 0.0);
+	const auto &limits = bounds();
+	size_t bucket = std::lower_bound(limits.begin(), limits.end(), seconds) - limits.begin();
+
+	// Only the bucket it lands in is counted, render() adds them up into Prometheus' cumulative buckets
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	sum_microseconds.fetch_add(static_cast<uint64_t>(std::llround(seconds * 1000000)), std::memory_order_relaxed);
+}
+
+uint64_t Histogram::get_count() const {
+	uint64_t count = 0;
+	for (const auto &bucket: buckets) {
+		count += bucket.load(std::memory_order_relaxed);
+	}
+
+	return count;
+}
+
+double Histogram::get_sum() const {
+	return sum_microseconds.load(std::memory_order_relaxed) / 1000000.0;
+}
+
+uint64_t Histogram::get_bucket(size_t bucket) const {
+	return buckets[bucket].load(std::memory_order_relaxed);
+}
+
+Metrics &Metrics::shared() {
+	static Metrics metrics;
+	return metrics;
+}
+
+Metrics::Family &Metrics::family(const std::string &name, const std::string &help, MetricType type) {
+	auto iter = families.find(name);
+	if (iter == families.end()) {
+		iter = families.emplace(name, Family { type, help }).first;
+	}
+
+	if (iter->second.type != type) {
+		throw std::runtime_error(name + ": Metric registered with a different type");
+	}
+
+	return iter->second;
+}
+
+Counter &Metrics::counter(const std::string &name, const std::string &help, MetricLabels labels) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Family &entry = family(name, help, MetricType::Counter);
+	Counter *&series = entry.counters[label_string(labels)];
+	if (series == nullptr) {
+		series = &counter_storage.emplace_back();
+	}
+
+	return *series;
+}
+
+Gauge &Metrics::gauge(const std::string &name, const std::string &help, MetricLabels labels) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Family &entry = family(name, help, MetricType::Gauge);
+	Gauge *&series = entry.gauges[label_string(labels)];
+	if (series == nullptr) {
+		series = &gauge_storage.emplace_back();
+	}
+
+	return *series;
+}
+
+Histogram &Metrics::histogram(const std::string &name, const std::string &help, MetricLabels labels) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Family &entry = family(name, help, MetricType::Histogram);
+	Histogram *&series = entry.histograms[label_string(labels)];
+	if (series == nullptr) {
+		series = &histogram_storage.emplace_back();
+	}
+
+	return *series;
+}
+
+void Metrics::callback_gauge(const std::string &name, const std::string &help, std::function<double()> callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+	family(name, help, MetricType::Gauge).callback = std::move(callback);
+}
+
+std::string Metrics::label_string(const MetricLabels &labels) {
+	std::string result;
+	for (const auto &[key, value]: labels) {
+		if (!result.empty()) {
+			result += ",";
+		}
+
+		result += key + "=\"";
+		for (char character: value) {
+			switch (character) {
+				case '\\':
+					result += "\\\\";
+					break;
+				case '"':
+					result += "\\\"";
+					break;
+				case '\n':
+					result += "\\n";
+					break;
+				default:
+					result += character;
+			}
+		}
+
+		result += "\"";
+	}
+
+	return result;
+}
+
+static std::string series_name(const std::string &name, const std::string &labels, const std::string &extra = "") {
+	std::string combined = labels;
+	if (!extra.empty()) {
+		combined += combined.empty() ? extra : "," + extra;
+	}
+
+	return combined.empty() ? name : name + "{" + combined + "}";
+}
+
+std::string Metrics::render() {
+	std::stringstream stream;
+	stream.precision(9);
+
+	// Values are read with relaxed loads while the lock only keeps the families from changing shape
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const auto &[name, entry]: families) {
+		switch (entry.type) {
+			case MetricType::Counter:
+				stream << "# HELP " << name << " " << entry.help << "\n";
+				stream << "# TYPE " << name << " counter\n";
+				for (const auto &[labels, series]: entry.counters) {
+					stream << series_name(name, labels) << " " << series->get() << "\n";
+				}
+
+				break;
+			case MetricType::Gauge:
+				stream << "# HELP " << name << " " << entry.help << "\n";
+				stream << "# TYPE " << name << " gauge\n";
+				if (entry.callback) {
+					stream << name << " " << entry.callback() << "\n";
+				}
+
+				for (const auto &[labels, series]: entry.gauges) {
+					stream << series_name(name, labels) << " " << series->get() << "\n";
+				}
+
+				break;
+			case MetricType::Histogram:
+				stream << "# HELP " << name << " " << entry.help << "\n";
+				stream << "# TYPE " << name << " histogram\n";
+				for (const auto &[labels, series]: entry.histograms) {
+					const auto &limits = Histogram::bounds();
+					uint64_t cumulative = 0;
+
+					for (size_t bucket = 0; bucket < Histogram::bucket_count; bucket++) {
+						cumulative += series->get_bucket(bucket);
+						std::stringstream bound;
+						bound << limits[bucket];
+						stream << series_name(name + "_bucket", labels, "le=\"" + bound.str() + "\"") << " " << cumulative << "\n";
+					}
+
+					cumulative += series->get_bucket(Histogram::bucket_count);
+					stream << series_name(name + "_bucket", labels, "le=\"+Inf\"") << " " << cumulative << "\n";
+					stream << series_name(name + "_sum", labels) << " " << series->get_sum() << "\n";
+					stream << series_name(name + "_count", labels) << " " << cumulative << "\n";
+				}
+
+				break;
+		}
+	}
+
+	return stream.str();
+}
+
+MetricTimer::MetricTimer() {
+	start = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double MetricTimer::elapsed() const {
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return (now - start) / 1000000000.0;
+}
@@ -0,0 +1,111 @@
+#include "PackagePipeline.hpp"
+#include "Configuration.hpp"
+#include "StanzaScanner.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
+#include "Tracing.hpp"
+
+PackagePipeline::PackagePipeline() : PackagePipeline(Configuration::shared().parse_arena) {}
+
+PackagePipeline::PackagePipeline(bool arena) {
+	batch_bytes = std::max<size_t>(Configuration::shared().parse_batch_bytes, 1);
+
+	// Batches are parsed on different threads at once, so the shared upstream has to be the synchronized one
+	if (arena) {
+		std::pmr::pool_options options;
+		options.largest_required_pool_block = batch_bytes * 4;
+		pool = std::make_shared<std::pmr::synchronized_pool_resource>(options);
+	}
+}
+
+void PackagePipeline::write(std::string_view data) {
+	pending.append(data);
+	total_bytes += data.size();
+
+	if (pending.size() < batch_bytes) {
+		return;
+	}
+
+	TraceSpan span("split_batch", {}, pending.size());
+
+	// Everything up to the last blank line is made of complete stanzas
+	// Bytes we already searched without luck (a giant stanza) aren't searched again
+	size_t boundary = StanzaScanner::rfind_boundary(std::string_view(pending).substr(scanned_bytes));
+	if (boundary == std::string_view::npos) {
+		scanned_bytes = pending.size() - 1;
+		return;
+	}
+
+	boundary += scanned_bytes;
+	std::string remainder = pending.substr(boundary + 2);
+	pending.resize(boundary + 2);
+	dispatch(std::move(pending));
+
+	pending = std::move(remainder);
+	scanned_bytes = 0;
+}
+
+PackageStore PackagePipeline::finish() {
+	TraceSpan span("merge_batches");
+	if (!pending.empty()) {
+		dispatch(std::move(pending));
+		pending.clear();
+	}
+
+	// Batches are merged in submission order so packages keep the order of the Packages file
+	// The result outlives the parse, so it's the one store that lives on the regular heap
+	PackageStore packages;
+	for (auto &batch: batches) {
+		packages.append(std::move(batch.get()->packages));
+	}
+
+	batches.clear();
+	return packages;
+}
+
+size_t PackagePipeline::bytes_written() const {
+	return total_bytes;
+}
+
+double PackagePipeline::parse_seconds() const {
+	return parse_nanoseconds->load(std::memory_order_relaxed) / 1000000000.0;
+}
+
+void PackagePipeline::dispatch(std::string content) {
+	// Streamed data comes in well under a batch at a time, so this is one part unless a single write was huge
+	// The parts all point into the one buffer, which is freed along with the last of them
+	auto buffer = std::make_shared<const std::string>(std::move(content));
+	for (auto chunk: StanzaScanner::partition(*buffer, buffer->size() / batch_bytes)) {
+		submit(buffer, chunk);
+	}
+}
+
+void PackagePipeline::submit(std::shared_ptr<const std::string> buffer, std::string_view chunk) {
+	batches.push_back(ThreadPool::shared().submit([buffer = std::move(buffer), chunk, parse_nanoseconds = parse_nanoseconds, pool = pool]() {
+		TraceSpan span("parse_batch", {}, chunk.size());
+		MetricTimer timer;
+
+		auto batch = pool ? std::make_unique<ParsedBatch>(pool, chunk.size() * 2) : std::make_unique<ParsedBatch>();
+		ControlStanza control_stanza(pool ? &batch->arena : std::pmr::get_default_resource());
+
+		// An arena never gets outgrown buffers back, so the store is sized once instead of doubling its way up
+		// The heap store grows as usual, counting stanzas for it would only scan the batch twice
+		if (pool) {
+			size_t stanzas = 0;
+			ControlParser::split(chunk, [&stanzas](std::string_view) {
+				stanzas++;
+			});
+
+			batch->packages.reserve(stanzas, chunk.size());
+		}
+
+		ControlParser::split(chunk, [&](std::string_view stanza) {
+			control_stanza.clear();
+			ControlParser::parse(stanza, control_stanza);
+			batch->packages.add(control_stanza);
+		});
+
+		parse_nanoseconds->fetch_add(static_cast<uint64_t>(timer.elapsed() * 1000000000), std::memory_order_relaxed);
+		return batch;
+	}));
+}
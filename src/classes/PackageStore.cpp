@@ -0,0 +1,492 @@
+#include "PackageStore.hpp"
+
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <atomic>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Bump whenever PackageField or any of the records change shape, old files are then simply ignored
+static constexpr uint32_t index_version = 1;
+static constexpr char index_magic[8] = { 'C', 'N', 'S', 'T', 'R', 'I', 'D', 'X' };
+
+struct IndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t field_count;
+	uint32_t record_size;
+	uint64_t record_count;
+	uint64_t overflow_count;
+	uint64_t interned_count;
+	uint64_t interned_bytes;
+	uint64_t text_bytes;
+	uint64_t metadata_bytes;
+	// CRC-32 of everything after the header
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+struct PackageStore::MappedFile {
+	void *data = MAP_FAILED;
+	size_t size = 0;
+
+	~MappedFile() {
+		if (data != MAP_FAILED) {
+			munmap(data, size);
+		}
+	}
+};
+
+// Sections start on 8 byte boundaries so the records can be used straight out of the mapping
+static size_t index_padding(size_t size) {
+	return (8 - size % 8) % 8;
+}
+
+static constexpr std::array<std::string_view, PackageStore::field_count> field_names = {
+	"Package",
+	"Version",
+	"Architecture",
+	"Name",
+	"Description",
+	"Section",
+	"Maintainer",
+	"Author",
+	"Depends",
+	"Pre-Depends",
+	"Conflicts",
+	"Replaces",
+	"Provides",
+	"Recommends",
+	"Suggests",
+	"Breaks",
+	"Filename",
+	"Size",
+	"Installed-Size",
+	"MD5sum",
+	"SHA1",
+	"SHA256",
+	"Homepage",
+	"Depiction",
+	"SileoDepiction",
+	"Icon",
+	"Tag",
+	"Priority",
+	"Essential"
+};
+
+std::string_view PackageStore::field_name(PackageField field) {
+	return field_names[static_cast<size_t>(field)];
+}
+
+bool PackageStore::lookup_field(std::string_view key, PackageField &field) {
+	static const std::unordered_map<std::string_view, PackageField> lookup = []() {
+		std::unordered_map<std::string_view, PackageField> map;
+		for (size_t index = 0; index < field_count; index++) {
+			map.emplace(field_names[index], static_cast<PackageField>(index));
+		}
+
+		return map;
+	}();
+
+	auto iter = lookup.find(key);
+	if (iter == lookup.end()) {
+		return false;
+	}
+
+	field = iter->second;
+	return true;
+}
+
+bool PackageStore::is_interned(PackageField field) {
+	switch (field) {
+		case PackageField::Architecture:
+		case PackageField::Section:
+		case PackageField::Maintainer:
+		case PackageField::Author:
+		case PackageField::Priority:
+		case PackageField::Essential:
+			return true;
+		default:
+			return false;
+	}
+}
+
+size_t PackageStore::add(const ControlStanza &stanza) {
+	ensure_mutable();
+	PackageRecord record;
+	record.overflow_offset = overflow.size();
+
+	for (const auto &field: stanza.fields) {
+		PackageField known_field;
+		if (!lookup_field(field.key, known_field)) {
+			overflow.push_back({ intern(field.key), store_text(field.value) });
+			record.overflow_count++;
+			continue;
+		}
+
+		Slot &slot = record.fields[static_cast<size_t>(known_field)];
+		if (is_interned(known_field)) {
+			slot.offset = intern(field.value);
+			slot.length = field.value.size();
+		} else {
+			slot = store_text(field.value);
+		}
+	}
+
+	records.push_back(record);
+	return records.size() - 1;
+}
+
+void PackageStore::append(PackageStore &&store) {
+	ensure_mutable();
+
+	// Adopting the arrays is only safe on the same resource, an arena-backed batch goes the long way
+	bool same_resource = *records.get_allocator().resource() == *store.records.get_allocator().resource();
+	if (same_resource && records.empty() && overflow.empty() && text.empty() && interned_values.empty()) {
+		*this = std::move(store);
+		return;
+	}
+
+	// Merging a mapped store means copying it out first, its arrays can't be adopted
+	if (store.mapping) {
+		PackageStore copy;
+		copy.text.assign(store.mapped_text, store.text_bytes());
+		copy.overflow.assign(store.mapped_overflow, store.mapped_overflow + store.overflow_count());
+		copy.records.assign(store.mapped_records, store.mapped_records + store.mapped_count);
+		for (size_t index = 0; index < store.mapped_interned_count; index++) {
+			copy.intern(store.interned_at(index));
+		}
+
+		store = std::move(copy);
+	}
+
+	// Plain values come over as one block, so their slots only need to be shifted
+	uint32_t text_base = text.size();
+	uint32_t overflow_base = overflow.size();
+	text.append(store.text);
+
+	// Interned ids are local to each store and have to be mapped onto ours
+	std::vector<uint32_t> interned_map(store.interned_values.size());
+	for (size_t index = 0; index < store.interned_values.size(); index++) {
+		interned_map[index] = intern(store.interned_values[index]);
+	}
+
+	for (const auto &field: store.overflow) {
+		overflow.push_back({ interned_map[field.key], { field.value.offset + text_base, field.value.length } });
+	}
+
+	records.reserve(records.size() + store.records.size());
+	for (auto record: store.records) {
+		for (size_t field = 0; field < field_count; field++) {
+			Slot &slot = record.fields[field];
+			if (slot.offset == absent) {
+				continue;
+			}
+
+			slot.offset = is_interned(static_cast<PackageField>(field)) ? interned_map[slot.offset] : slot.offset + text_base;
+		}
+
+		record.overflow_offset += overflow_base;
+		records.push_back(record);
+	}
+
+	store = PackageStore();
+}
+
+void PackageStore::reserve(size_t packages, size_t bytes) {
+	ensure_mutable();
+	records.reserve(packages);
+	text.reserve(bytes);
+}
+
+size_t PackageStore::size() const {
+	return mapping ? mapped_count : records.size();
+}
+
+size_t PackageStore::memory_usage() const {
+	// The kernel pages a mapping in on demand, this is the most it can ever take up
+	if (mapping) {
+		return mapping->size;
+	}
+
+	size_t usage = records.capacity() * sizeof(PackageRecord) + overflow.capacity() * sizeof(OverflowField) + text.capacity();
+	for (const auto &[value, id]: interned_lookup) {
+		usage += value.capacity() + sizeof(std::string_view) + sizeof(uint32_t);
+	}
+
+	return usage;
+}
+
+bool PackageStore::has(size_t index, PackageField field) const {
+	return record_at(index).fields[static_cast<size_t>(field)].offset != absent;
+}
+
+std::string_view PackageStore::get(size_t index, PackageField field) const {
+	const Slot &slot = record_at(index).fields[static_cast<size_t>(field)];
+	if (slot.offset == absent) {
+		return std::string_view();
+	}
+
+	return is_interned(field) ? interned_at(slot.offset) : text_view(slot);
+}
+
+std::string_view PackageStore::get(size_t index, std::string_view key) const {
+	PackageField field;
+	if (lookup_field(key, field)) {
+		return get(index, field);
+	}
+
+	const PackageRecord &record = record_at(index);
+	for (uint32_t offset = 0; offset < record.overflow_count; offset++) {
+		const OverflowField &overflow_field = overflow_at(record.overflow_offset + offset);
+		if (interned_at(overflow_field.key) == key) {
+			return text_view(overflow_field.value);
+		}
+	}
+
+	return std::string_view();
+}
+
+uint32_t PackageStore::intern(std::string_view value) {
+	// Looking up through a reused string saves us an allocation for every Maintainer we've already seen
+	static thread_local std::pmr::string lookup_key;
+	lookup_key.assign(value);
+
+	auto iter = interned_lookup.find(lookup_key);
+	if (iter != interned_lookup.end()) {
+		return iter->second;
+	}
+
+	uint32_t id = interned_values.size();
+	auto [inserted, _] = interned_lookup.emplace(lookup_key, id);
+	interned_values.push_back(inserted->first);
+	return id;
+}
+
+PackageStore::Slot PackageStore::store_text(std::string_view value) {
+	Slot slot = { static_cast<uint32_t>(text.size()), static_cast<uint32_t>(value.size()) };
+	text.append(value);
+	return slot;
+}
+
+void PackageStore::ensure_mutable() const {
+	if (mapping) {
+		throw std::runtime_error("Index files are read-only");
+	}
+}
+
+size_t PackageStore::overflow_count() const {
+	return mapping ? mapped_overflow_count : overflow.size();
+}
+
+size_t PackageStore::interned_count() const {
+	return mapping ? mapped_interned_count : interned_values.size();
+}
+
+size_t PackageStore::text_bytes() const {
+	return mapping ? mapped_text_bytes : text.size();
+}
+
+void PackageStore::save(const std::string &path, std::string_view metadata) const {
+	// Interned strings get a slot table of their own so a mapped store can resolve ids without building anything
+	std::vector<Slot> interned_slots;
+	std::string interned_text;
+	for (size_t index = 0; index < interned_count(); index++) {
+		std::string_view value = interned_at(index);
+		interned_slots.push_back({ static_cast<uint32_t>(interned_text.size()), static_cast<uint32_t>(value.size()) });
+		interned_text.append(value);
+	}
+
+	IndexHeader header = {};
+	std::memcpy(header.magic, index_magic, sizeof(index_magic));
+	header.version = index_version;
+	header.byte_order = 0x01020304;
+	header.field_count = field_count;
+	header.record_size = sizeof(PackageRecord);
+	header.record_count = size();
+	header.overflow_count = overflow_count();
+	header.interned_count = interned_slots.size();
+	header.interned_bytes = interned_text.size();
+	header.text_bytes = text_bytes();
+	header.metadata_bytes = metadata.size();
+
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+
+	// Written next to the real file and renamed over it, so a crash never leaves half an index
+	// Unique per save, two saves of the same path never write into each other's file
+	static std::atomic<uint64_t> temporary_count = 0;
+	std::string temporary_path = path + ".tmp-" + std::to_string(getpid()) + "-" + std::to_string(temporary_count++);
+	std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		throw std::runtime_error(path + ": Failed to open index file for writing");
+	}
+
+	uLong checksum = crc32(0, Z_NULL, 0);
+	static constexpr char zeroes[8] = {};
+	auto write = [&file, &checksum](const void *data, size_t size) {
+		const char *bytes = static_cast<const char *>(data);
+		file.write(bytes, size);
+
+		// zlib takes the length as a uInt, so huge sections go through in pieces
+		while (size > 0) {
+			uInt piece = size > UINT32_MAX ? UINT32_MAX : static_cast<uInt>(size);
+			checksum = crc32(checksum, reinterpret_cast<const Bytef *>(bytes), piece);
+			bytes += piece;
+			size -= piece;
+		}
+	};
+
+	auto write_section = [&write](const void *data, size_t size) {
+		write(data, size);
+		write(zeroes, index_padding(size));
+	};
+
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	write_section(size() > 0 ? &record_at(0) : nullptr, size() * sizeof(PackageRecord));
+	write_section(overflow_count() > 0 ? &overflow_at(0) : nullptr, overflow_count() * sizeof(OverflowField));
+	write_section(interned_slots.data(), interned_slots.size() * sizeof(Slot));
+	write_section(interned_text.data(), interned_text.size());
+	write_section(mapping ? mapped_text : text.data(), text_bytes());
+	write_section(metadata.data(), metadata.size());
+
+	header.checksum = checksum;
+	file.seekp(0);
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	file.close();
+
+	if (!file) {
+		std::filesystem::remove(temporary_path);
+		throw std::runtime_error(path + ": Failed to write index file");
+	}
+
+	std::filesystem::rename(temporary_path, path);
+}
+
+PackageStore PackageStore::load(const std::string &path, std::string &metadata) {
+	int descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (descriptor < 0) {
+		throw std::runtime_error(path + ": Failed to open index file");
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(IndexHeader)) {
+		close(descriptor);
+		throw std::runtime_error(path + ": Truncated index file");
+	}
+
+	auto mapped_file = std::make_shared<MappedFile>();
+	mapped_file->size = status.st_size;
+	mapped_file->data = mmap(nullptr, mapped_file->size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+
+	if (mapped_file->data == MAP_FAILED) {
+		throw std::runtime_error(path + ": Failed to map index file");
+	}
+
+	const char *base = static_cast<const char *>(mapped_file->data);
+	const IndexHeader *header = reinterpret_cast<const IndexHeader *>(base);
+
+	if (std::memcmp(header->magic, index_magic, sizeof(index_magic)) != 0) {
+		throw std::runtime_error(path + ": Not an index file");
+	}
+
+	// Anything written by a different build layout is just stale, the next index replaces it
+	if (header->version != index_version || header->byte_order != 0x01020304 || header->field_count != field_count || header->record_size != sizeof(PackageRecord)) {
+		throw std::runtime_error(path + ": Incompatible index file version");
+	}
+
+	// Sizes are checked one section at a time so an absurd count can't overflow the total
+	size_t offset = sizeof(IndexHeader);
+	auto section = [&](uint64_t count, size_t element_size) -> const char * {
+		if (element_size != 0 && count > (mapped_file->size - offset) / element_size) {
+			throw std::runtime_error(path + ": Truncated index file");
+		}
+
+		size_t size = count * element_size;
+		if (index_padding(size) > mapped_file->size - offset - size) {
+			throw std::runtime_error(path + ": Truncated index file");
+		}
+
+		const char *start = base + offset;
+		offset += size + index_padding(size);
+		return start;
+	};
+
+	PackageStore store;
+	store.mapped_records = reinterpret_cast<const PackageRecord *>(section(header->record_count, sizeof(PackageRecord)));
+	store.mapped_overflow = reinterpret_cast<const OverflowField *>(section(header->overflow_count, sizeof(OverflowField)));
+	store.mapped_interned = reinterpret_cast<const Slot *>(section(header->interned_count, sizeof(Slot)));
+	store.mapped_interned_text = section(header->interned_bytes, 1);
+	store.mapped_text = section(header->text_bytes, 1);
+	const char *metadata_start = section(header->metadata_bytes, 1);
+
+	if (offset != mapped_file->size) {
+		throw std::runtime_error(path + ": Corrupt index file");
+	}
+
+	uLong checksum = crc32(0, Z_NULL, 0);
+	const char *bytes = base + sizeof(IndexHeader);
+	size_t remaining = mapped_file->size - sizeof(IndexHeader);
+	while (remaining > 0) {
+		uInt piece = remaining > UINT32_MAX ? UINT32_MAX : static_cast<uInt>(remaining);
+		checksum = crc32(checksum, reinterpret_cast<const Bytef *>(bytes), piece);
+		bytes += piece;
+		remaining -= piece;
+	}
+
+	if (checksum != header->checksum) {
+		throw std::runtime_error(path + ": Index file checksum mismatch");
+	}
+
+	// The checksum only catches damage, the views we hand out must stay inside the mapping whatever the file says
+	auto inside = [](uint64_t offset, uint64_t length, uint64_t size) {
+		return offset <= size && length <= size - offset;
+	};
+
+	const Slot *interned_slots = store.mapped_interned;
+	for (uint64_t id = 0; id < header->interned_count; id++) {
+		if (!inside(interned_slots[id].offset, interned_slots[id].length, header->interned_bytes)) {
+			throw std::runtime_error(path + ": Corrupt index file");
+		}
+	}
+
+	for (uint64_t index = 0; index < header->record_count; index++) {
+		const PackageRecord &record = store.mapped_records[index];
+		for (size_t field = 0; field < field_count; field++) {
+			const Slot &slot = record.fields[field];
+			if (slot.offset == absent) {
+				continue;
+			}
+
+			bool valid = is_interned(static_cast<PackageField>(field)) ? slot.offset < header->interned_count : inside(slot.offset, slot.length, header->text_bytes);
+			if (!valid) {
+				throw std::runtime_error(path + ": Corrupt index file");
+			}
+		}
+
+		if (!inside(record.overflow_offset, record.overflow_count, header->overflow_count)) {
+			throw std::runtime_error(path + ": Corrupt index file");
+		}
+	}
+
+	for (uint64_t index = 0; index < header->overflow_count; index++) {
+		const OverflowField &field = store.mapped_overflow[index];
+		if (field.key >= header->interned_count || !inside(field.value.offset, field.value.length, header->text_bytes)) {
+			throw std::runtime_error(path + ": Corrupt index file");
+		}
+	}
+
+	metadata.assign(metadata_start, header->metadata_bytes);
+	store.mapped_count = header->record_count;
+	store.mapped_overflow_count = header->overflow_count;
+	store.mapped_interned_count = header->interned_count;
+	store.mapped_text_bytes = header->text_bytes;
+	store.mapping = std::move(mapped_file);
+	return store;
+}
@@ -0,0 +1,391 @@
+#include "RefreshScheduler.hpp"
+#include "Configuration.hpp"
+#include "JobExecutor.hpp"
+#include "Metrics.hpp"
+
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+
+RefreshScheduler &RefreshScheduler::shared() {
+	static RefreshScheduler scheduler;
+	return scheduler;
+}
+
+RefreshScheduler::RefreshScheduler() : random(std::random_device()()) {
+	Configuration &configuration = Configuration::shared();
+	path = configuration.cache_directory + "/refresh.json";
+	default_interval = configuration.refresh_interval_seconds;
+	min_interval = std::max<double>(configuration.refresh_min_interval_seconds, 1);
+	max_interval = std::max<double>(configuration.refresh_max_interval_seconds, min_interval);
+	expiry = configuration.refresh_expiry_seconds;
+	max_entries = std::max<size_t>(configuration.refresh_max_repositories, 1);
+
+	// Half of the index jobs at most, clients asking for an index never queue behind a full round of refreshes
+	max_running = std::max<size_t>(configuration.index_jobs / 2, 1);
+
+	load();
+}
+
+RefreshScheduler::~RefreshScheduler() {
+	stop_source.request_stop();
+	if (thread.joinable()) {
+		thread.request_stop();
+		thread.join();
+	}
+}
+
+void RefreshScheduler::start() {
+	if (default_interval <= 0 || thread.joinable()) {
+		return;
+	}
+
+	thread = std::jthread([this](std::stop_token stop_token) {
+		run(stop_token);
+	});
+}
+
+void RefreshScheduler::track(const std::vector<RefreshTarget> &targets) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Clock::time_point now = Clock::now();
+		for (const auto &target: targets) {
+			std::string key = RepositoryParser::make_key(target.uri, target.dist, target.suite);
+			auto iter = entries.find(key);
+			if (iter != entries.end()) {
+				iter->second.target = target;
+				iter->second.last_requested = now;
+				continue;
+			}
+
+			Entry entry = { target, std::clamp(default_interval, min_interval, max_interval) };
+			entry.last_requested = now;
+			schedule(entry);
+			entries.emplace(key, std::move(entry));
+		}
+
+		for (const auto &key: evict()) {
+			RepositorySnapshot::forget(key);
+		}
+
+		save();
+		woken = true;
+	}
+
+	condition.notify_all();
+}
+
+void RefreshScheduler::report(const std::string &key, RefreshOutcome outcome) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = entries.find(key);
+		if (iter == entries.end()) {
+			return;
+		}
+
+		adapt(iter->second, outcome);
+		save();
+		woken = true;
+	}
+
+	condition.notify_all();
+}
+
+std::optional<RepositoryInfo> RefreshScheduler::find_info(const std::string &key) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iter = entries.find(key);
+	if (iter == entries.end()) {
+		return std::nullopt;
+	}
+
+	return iter->second.target.info;
+}
+
+size_t RefreshScheduler::get_tracked_count() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return entries.size();
+}
+
+RefreshOutcome RefreshScheduler::outcome(const RepositoryParser &parser) {
+	if (parser.is_failed()) {
+		return RefreshOutcome::Failed;
+	}
+
+	// A new Release with the same packages in it didn't really change anything
+	if (parser.is_unchanged() || (!parser.get_delta().full && parser.get_delta().empty())) {
+		return RefreshOutcome::Unchanged;
+	}
+
+	return RefreshOutcome::Changed;
+}
+
+void RefreshScheduler::adapt(Entry &entry, RefreshOutcome outcome) {
+	switch (outcome) {
+		case RefreshOutcome::Changed:
+			entry.interval = std::max(entry.interval / 2, min_interval);
+			entry.failures = 0;
+			break;
+		case RefreshOutcome::Unchanged:
+			entry.interval = std::min(entry.interval * 1.5, max_interval);
+			entry.failures = 0;
+			break;
+		case RefreshOutcome::Failed:
+			entry.failures++;
+			break;
+	}
+
+	schedule(entry);
+}
+
+void RefreshScheduler::schedule(Entry &entry) {
+	// Ranking 1 is refreshed three times as often as ranking 5
+	double ranking = std::clamp(entry.target.info.ranking, 1.0, 5.0);
+	double delay = entry.interval * (1 + (ranking - 1) * 0.5);
+
+	// Failures back off from the minimum on their own, a mirror that's down says nothing about how often it changes
+	if (entry.failures > 0) {
+		delay = std::min(min_interval * std::pow(2.0, std::min<size_t>(entry.failures, 16)), max_interval);
+	}
+
+	entry.next_refresh = Clock::now() + std::chrono::milliseconds(static_cast<int64_t>(jitter(delay) * 1000));
+}
+
+double RefreshScheduler::jitter(double seconds) {
+	// ±10%, so repositories registered together don't all come due together
+	std::uniform_real_distribution<double> distribution(0.9, 1.1);
+	return seconds * distribution(random);
+}
+
+void RefreshScheduler::run(std::stop_token stop_token) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!stop_token.stop_requested()) {
+		Clock::time_point now = Clock::now();
+		Clock::time_point wake = now + std::chrono::minutes(1);
+
+		std::vector<std::string> expired = expire(now);
+		for (const auto &key: expired) {
+			RepositorySnapshot::forget(key);
+		}
+
+		if (!expired.empty()) {
+			save();
+		}
+
+		std::vector<std::pair<const std::string *, Entry *>> due;
+		for (auto &[key, entry]: entries) {
+			if (entry.running) {
+				continue;
+			}
+
+			if (entry.next_refresh <= now) {
+				due.emplace_back(&key, &entry);
+			} else {
+				wake = std::min(wake, entry.next_refresh);
+			}
+		}
+
+		// When there's more due than we may run, the best ranked and most overdue go first
+		std::sort(due.begin(), due.end(), [](const auto &left, const auto &right) {
+			if (left.second->target.info.ranking != right.second->target.info.ranking) {
+				return left.second->target.info.ranking < right.second->target.info.ranking;
+			}
+
+			return left.second->next_refresh < right.second->next_refresh;
+		});
+
+		for (auto &[key, entry]: due) {
+			if (running_count >= max_running) {
+				break;
+			}
+
+			refresh(*key, *entry);
+		}
+
+		// Woken early by a registration, a report or a refresh finishing
+		condition.wait_until(lock, stop_token, wake, [this]() {
+			return woken;
+		});
+
+		woken = false;
+	}
+}
+
+std::vector<std::string> RefreshScheduler::expire(Clock::time_point now) {
+	std::vector<std::string> expired;
+	if (expiry <= 0) {
+		return expired;
+	}
+
+	// A running refresh finishes first, the next pass gets it
+	Clock::time_point cutoff = now - std::chrono::seconds(static_cast<int64_t>(expiry));
+	for (auto iter = entries.begin(); iter != entries.end();) {
+		if (!iter->second.running && iter->second.last_requested < cutoff) {
+			expired.push_back(iter->first);
+			iter = entries.erase(iter);
+		} else {
+			++iter;
+		}
+	}
+
+	return expired;
+}
+
+std::vector<std::string> RefreshScheduler::evict() {
+	std::vector<std::string> evicted;
+	if (entries.size() <= max_entries) {
+		return evicted;
+	}
+
+	std::vector<std::pair<Clock::time_point, const std::string *>> candidates;
+	for (const auto &[key, entry]: entries) {
+		if (!entry.running) {
+			candidates.emplace_back(entry.last_requested, &key);
+		}
+	}
+
+	size_t excess = std::min(entries.size() - max_entries, candidates.size());
+	std::partial_sort(candidates.begin(), candidates.begin() + excess, candidates.end(), [](const auto &left, const auto &right) {
+		return left.first < right.first;
+	});
+
+	for (size_t index = 0; index < excess; index++) {
+		evicted.push_back(*candidates[index].second);
+	}
+
+	for (const auto &key: evicted) {
+		entries.erase(key);
+	}
+
+	return evicted;
+}
+
+void RefreshScheduler::refresh(const std::string &key, Entry &entry) {
+	entry.running = true;
+	running_count++;
+
+	RefreshTarget target = entry.target;
+	JobExecutor::shared().submit([this, key, target](std::stop_token stop_token) {
+		RefreshOutcome result = RefreshOutcome::Failed;
+
+		try {
+			RepositoryParser parser(target.uri, target.dist, target.suite);
+			parser.set_stop_token(stop_token);
+			parser.set_background(true);
+			parser.index_repository();
+
+			SearchIndex::shared().update(parser.repository_key(), parser.get_snapshot(), target.info);
+			result = outcome(parser);
+		} catch (std::exception &exc) {
+			std::cout << target.uri << ": Refresh failed - " << exc.what() << std::endl;
+		}
+
+		finish(key, result);
+	}, stop_source.get_token(), target.info.ranking, RepositoryParser::host(target.uri));
+}
+
+void RefreshScheduler::finish(const std::string &key, RefreshOutcome outcome) {
+	static const char *names[] = { "changed", "unchanged", "failed" };
+	Metrics::shared().counter("canister_refresh_total", "Background refreshes, by outcome", {
+		{ "result", names[static_cast<size_t>(outcome)] }
+	}).add();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running_count--;
+
+		auto iter = entries.find(key);
+		if (iter != entries.end()) {
+			iter->second.running = false;
+			adapt(iter->second, outcome);
+		}
+
+		save();
+		woken = true;
+	}
+
+	condition.notify_all();
+}
+
+void RefreshScheduler::load() {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		return;
+	}
+
+	nlohmann::json saved;
+	try {
+		saved = nlohmann::json::parse(file);
+	} catch (std::exception &exc) {
+		std::cout << path << ": Failed to load refresh schedule - " << exc.what() << std::endl;
+		return;
+	}
+
+	Clock::time_point now = Clock::now();
+	for (const auto &object: saved) {
+		try {
+			RefreshTarget target;
+			target.uri = object["uri"].get<std::string>();
+			target.dist = object["dist"].get<std::string>();
+			target.suite = object["suite"].get<std::string>();
+			target.info.uri = target.uri;
+			target.info.slug = object["slug"].get<std::string>();
+			target.info.aliases = object["aliases"].get<std::vector<std::string>>();
+			target.info.ranking = object["ranking"].get<double>();
+
+			Entry entry = { target, std::clamp(object["interval"].get<double>(), min_interval, max_interval) };
+			entry.failures = object["failures"].get<size_t>();
+			entry.next_refresh = Clock::time_point(std::chrono::seconds(object["next_refresh"].get<int64_t>()));
+
+			// Schedules saved before requests were timed count as asked for now
+			entry.last_requested = object.contains("last_requested") ? Clock::time_point(std::chrono::seconds(object["last_requested"].get<int64_t>())) : now;
+
+			// Whatever came due while we were down is spread out instead of all going at once
+			if (entry.next_refresh < now) {
+				std::uniform_real_distribution<double> distribution(0, min_interval);
+				entry.next_refresh = now + std::chrono::milliseconds(static_cast<int64_t>(distribution(random) * 1000));
+			}
+
+			entries.emplace(RepositoryParser::make_key(target.uri, target.dist, target.suite), std::move(entry));
+		} catch (std::exception &exc) {
+			continue;
+		}
+	}
+
+	// A lowered limit applies straight away, nothing's holding changes for a client yet
+	evict();
+}
+
+void RefreshScheduler::save() {
+	nlohmann::json saved = nlohmann::json::array();
+	for (const auto &[key, entry]: entries) {
+		saved.push_back({
+			{"uri", entry.target.uri},
+			{"dist", entry.target.dist},
+			{"suite", entry.target.suite},
+			{"slug", entry.target.info.slug},
+			{"aliases", entry.target.info.aliases},
+			{"ranking", entry.target.info.ranking},
+			{"interval", entry.interval},
+			{"failures", entry.failures},
+			{"next_refresh", std::chrono::duration_cast<std::chrono::seconds>(entry.next_refresh.time_since_epoch()).count()},
+			{"last_requested", std::chrono::duration_cast<std::chrono::seconds>(entry.last_requested.time_since_epoch()).count()}
+		});
+	}
+
+	try {
+		// Written next to the real file and renamed over it, so a crash never leaves half of it
+		std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+		std::string temporary_path = path + ".tmp";
+		std::ofstream file(temporary_path, std::ios::trunc);
+		file << saved.dump();
+		file.close();
+
+		std::filesystem::rename(temporary_path, path);
+	} catch (std::exception &exc) {
+		std::cout << path << ": Failed to save refresh schedule - " << exc.what() << std::endl;
+	}
+}
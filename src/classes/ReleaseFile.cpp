@@ -0,0 +1,111 @@
+#include "ReleaseFile.hpp"
+
+#include <charconv>
+
+ReleaseFile ReleaseFile::parse(std::string_view content) {
+	ReleaseFile release;
+	std::string_view current_key;
+	bool signed_message = content.starts_with("-----BEGIN PGP SIGNED MESSAGE-----");
+	bool in_armor_header = signed_message;
+	size_t position = 0;
+
+	while (position < content.size()) {
+		size_t line_end = content.find('\n', position);
+		if (line_end == std::string_view::npos) {
+			line_end = content.size();
+		}
+
+		std::string_view line = content.substr(position, line_end - position);
+		position = line_end + 1;
+
+		if (line.ends_with('\r')) {
+			line.remove_suffix(1);
+		}
+
+		// InRelease wraps everything in a clearsigned message, skip the armor and stop at the signature
+		if (signed_message) {
+			if (in_armor_header) {
+				in_armor_header = !line.empty();
+				continue;
+			}
+
+			if (line.starts_with("-----BEGIN PGP SIGNATURE-----")) {
+				break;
+			}
+
+			if (line.starts_with("- ")) {
+				line.remove_prefix(2);
+			}
+		}
+
+		if (line.empty()) {
+			continue;
+		}
+
+		if (line.front() != ' ' && line.front() != '\t') {
+			current_key = line.substr(0, line.find(':'));
+			continue;
+		}
+
+		if (current_key != "SHA256" && current_key != "MD5Sum") {
+			continue;
+		}
+
+		// Checksum lines are " <hash> <size> <path>" with any amount of padding in between
+		std::string_view fields[3];
+		size_t field_count = 0;
+		size_t field_position = 0;
+
+		while (field_count < 3) {
+			size_t start = line.find_first_not_of(" \t", field_position);
+			if (start == std::string_view::npos) {
+				break;
+			}
+
+			size_t end = field_count == 2 ? line.size() : line.find_first_of(" \t", start);
+			if (end == std::string_view::npos) {
+				end = line.size();
+			}
+
+			fields[field_count++] = line.substr(start, end - start);
+			field_position = end;
+		}
+
+		if (field_count != 3) {
+			continue;
+		}
+
+		std::string path(fields[2]);
+		if (path.starts_with("./")) {
+			path.erase(0, 2);
+		}
+
+		// The size is checked before the entry exists, a line we can't read shouldn't leave a zero byte candidate behind
+		size_t size = 0;
+		auto [size_end, error] = std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), size);
+		if (error != std::errc() || size_end != fields[1].data() + fields[1].size()) {
+			continue;
+		}
+
+		ReleaseEntry &entry = release.entries[path];
+		entry.path = path;
+		entry.size = size;
+
+		if (current_key == "SHA256") {
+			entry.sha256 = fields[0];
+		} else {
+			entry.md5 = fields[0];
+		}
+	}
+
+	return release;
+}
+
+const ReleaseEntry *ReleaseFile::find(std::string_view path) const {
+	auto iter = entries.find(std::string(path));
+	return iter == entries.end() ? nullptr : &iter->second;
+}
+
+bool ReleaseFile::empty() const {
+	return entries.empty();
+}
@@ -1,4 +1,50 @@
 #include "RepositoryParser.hpp"
+#include "Configuration.hpp"
+#include "ThreadPool.hpp"
+#include "Metrics.hpp"
+#include "Tracing.hpp"
+
+#include <unordered_set>
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+
+// Repositories are broken down by mirror, but hosts come from clients too
+// Only the first hosts seen get series of their own, the rest share "other" so a flood of URLs can't grow the metrics
+static std::string host_label(const std::string &url) {
+	static std::mutex mutex;
+	static std::unordered_set<std::string> hosts;
+	std::string host = RepositoryParser::host(url);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (hosts.contains(host)) {
+		return host;
+	}
+
+	if (hosts.size() < Configuration::shared().metrics_max_hosts) {
+		hosts.insert(host);
+		return host;
+	}
+
+	return "other";
+}
+
+static void observe_transfer(const std::string &host, const TransferTimings &timings) {
+	std::pair<const char *, double> phases[] = {
+		{ "dns", timings.dns },
+		{ "connect", timings.connect },
+		{ "tls", timings.tls },
+		{ "first_byte", timings.first_byte },
+		{ "download", timings.download }
+	};
+
+	for (const auto &[phase, seconds]: phases) {
+		Metrics::shared().histogram("canister_http_phase_seconds", "Time spent in each phase of a repository HTTP request", {
+			{ "host", host },
+			{ "phase", phase }
+		}).observe(seconds);
+	}
+}
 
 RepositoryParser::RepositoryParser(std::string url) {
 	this->url = url;
@@ -10,466 +56,491 @@ RepositoryParser::RepositoryParser(std::string url, std::string dist, std::strin
 	this->suite = suite;
 }
 
-int RepositoryParser::index_repository() {
-	if (dist.empty() && suite.empty()) {
-		return index_simple_repository();
-	} else {
-		return index_distribution_repository();
-	}
+void RepositoryParser::set_stop_token(std::stop_token stop_token) {
+	this->stop_token = stop_token;
 }
 
-int RepositoryParser::index_simple_repository() {
-	if (url.size() == 0) {
-		return -1;
-	}
+void RepositoryParser::set_background(bool background) {
+	this->background = background;
+}
 
-	if (url.ends_with("/")) {
-		url.pop_back();
+bool RepositoryParser::collect_changes() {
+	auto collected = RepositorySnapshot::collect(repository_key());
+	if (!collected.has_value() || collected->second == nullptr) {
+		return false;
 	}
 
-	std::string content = fetch_packages(url);
+	// Whatever this index found itself is part of it, the baseline predates it
+	auto &[baseline, current] = *collected;
+	snapshot = current;
+	delta = current->diff(baseline.get());
+	unchanged = false;
+	return true;
+}
 
-	size_t start;
-	size_t end = 0;
-	std::vector<std::map<std::string, std::string>> packages;
-	std::vector<std::future<std::map<std::string, std::string>>> package_threads;
+bool RepositoryParser::is_unchanged() const {
+	return unchanged;
+}
 
-	while ((start = content.find_first_not_of("\n\n", end)) != std::string::npos) {
-		end = content.find("\n\n", start);
+bool RepositoryParser::is_failed() const {
+	return failed;
+}
 
-		// We want to do each package on a separate thread (hopefully BigBoss plays nicely)
-		package_threads.push_back(std::async(&RepositoryParser::map_package, this, std::stringstream(content.substr(start, end - start))));
-	}
+const PackageDelta &RepositoryParser::get_delta() const {
+	return delta;
+}
 
-	for (auto &result: package_threads) {
-		packages.push_back(result.get());
-	}
+std::shared_ptr<const RepositorySnapshot> RepositoryParser::get_snapshot() const {
+	return snapshot;
+}
 
-	return packages.size();
+std::string RepositoryParser::repository_key() const {
+	return make_key(url, dist, suite);
 }
 
-int RepositoryParser::index_distribution_repository() {
+std::string RepositoryParser::make_key(std::string url, std::string dist, std::string suite) {
+	// Indexing drops the trailing slash, the key has to match before and after
 	if (url.ends_with("/")) {
 		url.pop_back();
 	}
 
-	std::string fetch_url = url + "/dists/" + dist + "/" + suite + "/binary-iphoneos-arm";
-	std::string content = fetch_packages(fetch_url);
-
-	size_t start;
-	size_t end = 0;
-	std::vector<std::map<std::string, std::string>> packages;
-	std::vector<std::future<std::map<std::string, std::string>>> package_threads;
+	return url + "|" + dist + "|" + suite;
+}
 
-	while ((start = content.find_first_not_of("\n\n", end)) != std::string::npos) {
-		end = content.find("\n\n", start);
+std::string RepositoryParser::host(std::string url) {
+	size_t scheme = url.find("://");
+	std::string host = scheme == std::string::npos ? url : url.substr(scheme + 3);
+	host = host.substr(0, host.find('/'));
 
-		// We want to do each package on a separate thread (hopefully BigBoss plays nicely)
-		package_threads.push_back(std::async(&RepositoryParser::map_package, this, std::stringstream(content.substr(start, end - start))));
+	size_t credentials = host.rfind('@');
+	if (credentials != std::string::npos) {
+		host = host.substr(credentials + 1);
 	}
 
-	for (auto &result: package_threads) {
-		packages.push_back(result.get());
-	}
+	std::transform(host.begin(), host.end(), host.begin(), [](unsigned char value) {
+		return std::tolower(value);
+	});
 
-	return packages.size();
+	return host;
 }
 
-std::string RepositoryParser::fetch_packages(std::string url) {
-	try {
-		// ZSTD
-		std::string zstd_buffer = fetch_packages_zstd(url);
-		if (!zstd_buffer.empty()) return zstd_buffer;
+int RepositoryParser::publish_packages(PackageStore packages) {
+	TraceSpan span("publish_packages", url);
+	std::shared_ptr<const RepositorySnapshot> previous = RepositorySnapshot::find(repository_key());
 
-		// BZip2
-		std::string bzip2_buffer = fetch_packages_bzip2(url);
-		if (!bzip2_buffer.empty()) return bzip2_buffer;
+	// A failed fetch must never look like every package got removed
+	if (failed) {
+		snapshot = previous;
+		return 0;
+	}
 
-		// GZip
-		std::string gzip_buffer = fetch_packages_gzip(url);
-		if (!gzip_buffer.empty()) return gzip_buffer;
+	// Servers without validators still hand us the exact same bytes when nothing changed
+	if (!unchanged && previous != nullptr && previous->get_source_fingerprint() == source_fingerprint) {
+		unchanged = true;
+	}
 
-		// Normal
-		std::string normal_buffer = fetch_packages_normal(url);
-		if (!normal_buffer.empty()) return normal_buffer;
+	if (unchanged) {
+		snapshot = previous;
+		return previous != nullptr ? previous->get_packages().size() : package_count;
+	}
 
-		throw std::runtime_error(url + ": No Packages file found");
-	} catch (std::exception &exc) {
-		std::cout << exc.what() << std::endl;
+	snapshot = std::make_shared<const RepositorySnapshot>(std::move(packages), source_fingerprint);
+	delta = snapshot->diff(previous.get());
+	RepositorySnapshot::publish(repository_key(), snapshot, background);
+
+	return snapshot->get_packages().size();
+}
+
+std::optional<CacheValidators> RepositoryParser::find_validators(std::string url, std::string key) {
+	// A 304 is useless without the snapshot or the cached body it would be confirming, so only revalidate with one
+	if (RepositorySnapshot::find(repository_key()) == nullptr && !DownloadCache::shared().contains(url)) {
+		return std::nullopt;
 	}
 
-	return std::string();
+	return ValidatorCache::shared().find(key.empty() ? url : key);
 }
 
-std::map<std::string, std::string> RepositoryParser::map_package(std::stringstream stream) {
-	std::map<std::string, std::string> control_map;
-	std::string line, previousKey;
+int RepositoryParser::index_repository() {
+	TraceSpan span("index_repository", url);
+	MetricTimer timer;
 
-	while (std::getline(stream, line, '\n')) {
-		if (line.size() == 0) {
-			continue;
-		}
+	int package_count = dist.empty() && suite.empty() ? index_simple_repository() : index_distribution_repository();
 
-		std::smatch matches;
-		if (!std::regex_match(line, matches, std::regex("^(.*?): (.*)"))) {
-			// There's a chance instead of multiline, some idiot just gave a key without value
-			// Trim the string incase there may be a space after the colon
-			size_t end = line.find_last_not_of(' ');
-			end == std::string::npos ? line = "" : line = line.substr(0, end + 1);
+	// Wall time of the whole repository (fetch, decompress, parse, publish) and how it ended
+	std::string result = failed ? "failed" : unchanged ? "unchanged" : "indexed";
+	Metrics &metrics = Metrics::shared();
+	metrics.histogram("canister_index_seconds", "Time spent indexing a repository, by mirror and outcome", { { "host", host_label(url) }, { "result", result } }).observe(timer.elapsed());
+	metrics.counter("canister_index_total", "Repositories indexed, by outcome", { { "result", result } }).add();
 
-			if (!line.ends_with(":")) {
-				control_map[previousKey].append("\n" + line);
-			}
-		}
+	return package_count;
+}
 
-		if (matches.size() != 3) {
-			continue;
-		}
+int RepositoryParser::index_simple_repository() {
+	if (url.size() == 0) {
+		return -1;
+	}
 
-		control_map.insert(std::make_pair(matches[1], matches[2]));
-		previousKey = matches[1];
+	if (url.ends_with("/")) {
+		url.pop_back();
 	}
 
-	return control_map;
+	PackageStore packages = fetch_packages(url, "");
+	return publish_packages(std::move(packages));
 }
 
-std::string RepositoryParser::fetch_packages_gzip(std::string url) {
-	try {
-		// Write the response data to a file and decompress it
-		std::string file_name = curl_generic_url(url + "/Packages.gz");
-		std::ifstream cache_file(("/tmp/" + file_name).c_str());
-		if (!cache_file.is_open()) {
-			throw std::runtime_error(url + ": Failed to open compressed file - GZip");
-		}
+int RepositoryParser::index_distribution_repository() {
+	if (url.ends_with("/")) {
+		url.pop_back();
+	}
 
-		// Converts our ifstream to a string using streambuf iterators
-		std::string buffer_data = std::string((std::istreambuf_iterator<char>(cache_file)), std::istreambuf_iterator<char>());
-		std::string output_data;
-		size_t max_size(16384);
-		z_stream inflate_stream;
-
-		// zLIB why do you feel a need
-		inflate_stream.zalloc = Z_NULL;
-		inflate_stream.zfree = Z_NULL;
-		inflate_stream.opaque = Z_NULL;
-		inflate_stream.next_in = Z_NULL;
-		inflate_stream.avail_in = 0;
-
-		// windowBits 15
-		// ENABLE_ZLIB_GZIP 32
-		int status = inflateInit2(&inflate_stream, 15 | 32);
-		if (status < 0) {
-			throw std::runtime_error(url + ": GZip failed to initialize zLIB inflate");
-		}
+	// The Release file sits at the root of the dist, its entries are relative to it
+	PackageStore packages = fetch_packages(url + "/dists/" + dist, suite + "/binary-iphoneos-arm");
+	return publish_packages(std::move(packages));
+}
 
-		std::size_t inflated_size = 0;
-		std::size_t buffer_size = buffer_data.size();
+PackageStore RepositoryParser::fetch_packages(std::string release_url, std::string packages_path) {
+	std::string url = packages_path.empty() ? release_url : release_url + "/" + packages_path;
+	std::string path_prefix = packages_path.empty() ? "" : packages_path + "/";
+	std::vector<PackagesCandidate> candidates;
 
-		// Because of zLIB's weird pointer magic, we need to reinterpret this as a pointer first
-		inflate_stream.next_in = reinterpret_cast<z_const Bytef *>(buffer_data.data());
-		if (buffer_size > max_size || (buffer_size * 2) > max_size) {
-			inflateEnd(&inflate_stream);
-			throw std::runtime_error(url + ": GZip inflate may use more memory due to size");
+	// The Release file tells us which variants exist and how big they are, so only the cheapest is downloaded
+	// A 304 on it means nothing in the repository changed and we're done already
+	ReleaseFile release = fetch_release(release_url);
+	if (unchanged) {
+		return PackageStore();
+	}
+
+	for (auto format: packages_formats) {
+		const ReleaseEntry *entry = release.find(path_prefix + "Packages" + Decompressor::extension(format));
+		if (entry != nullptr) {
+			candidates.push_back({ format, entry->size, true, entry });
 		}
+	}
 
-		inflate_stream.avail_in = static_cast<unsigned int>(buffer_size);
+	// Without a Release file we still shouldn't pay a round-trip per format, so every probe goes out at once
+	if (candidates.empty()) {
+		candidates = probe_packages(url);
+	}
 
-		do {
-			// The string buffer needs a reference of it's next resize so it may expand to fit data
-			std::size_t next_resize = inflated_size + 2 * buffer_size;
+	std::stable_sort(candidates.begin(), candidates.end(), [](const PackagesCandidate &left, const PackagesCandidate &right) {
+		if (left.size_known && right.size_known) {
+			return left.size < right.size;
+		}
 
-			if (next_resize > max_size) {
-				inflateEnd(&inflate_stream);
-				throw std::runtime_error(url + ": GZip decompression reference size exceeds max size");
-			}
+		return left.size_known && !right.size_known;
+	});
 
-			output_data.resize(next_resize);
+	for (const auto &candidate: candidates) {
+		if (stop_token.stop_requested()) {
+			break;
+		}
 
-			// Expand the size of our zLIB stream too so it can continue inflating
-			inflate_stream.avail_out = static_cast<unsigned int>(2 * buffer_size);
-			inflate_stream.next_out = reinterpret_cast<Bytef *>(&output_data[0] + inflated_size);
+		try {
+			return commit_packages(fetch_packages_stream(url, candidate.format, candidate.entry));
+		} catch (std::exception &exc) {
+			std::cout << exc.what() << std::endl;
+		}
+	}
 
-			int inflate_status = inflate(&inflate_stream, Z_FINISH);
+	// Stale Release files and servers that can't answer HEAD still get the old serial walk as a last resort
+	for (auto format: packages_formats) {
+		bool attempted = std::any_of(candidates.begin(), candidates.end(), [format](const PackagesCandidate &candidate) {
+			return candidate.format == format;
+		});
 
-			// If this happens we didn't reach Z_FINISH and the buffer is just dead
-			if (inflate_status != Z_STREAM_END && inflate_status != Z_OK && inflate_status != Z_BUF_ERROR) {
-				std::string error_message = inflate_stream.msg;
-				inflateEnd(&inflate_stream);
+		if (attempted || stop_token.stop_requested()) {
+			continue;
+		}
 
-				throw std::runtime_error(url + ": GZip finish error: zLIB - " + error_message);
-			}
+		try {
+			return commit_packages(fetch_packages_stream(url, format));
+		} catch (std::exception &exc) {
+			std::cout << exc.what() << std::endl;
+		}
+	}
 
-			inflated_size += (2 * buffer_size - inflate_stream.avail_out);
-		} while (inflate_stream.avail_out == 0);
+	// A cancelled job is treated like a failed fetch, the previous snapshot stays published
+	if (stop_token.stop_requested()) {
+		std::cout << url << ": Cancelled" << std::endl;
+	} else {
+		std::cout << url << ": No Packages file found" << std::endl;
+	}
 
-		inflateEnd(&inflate_stream);
-		output_data.resize(inflated_size);
+	failed = true;
+	return PackageStore();
+}
 
-		return output_data;
-	} catch (std::exception &exc) {
-		std::cout << exc.what() << std::endl;
-		return std::string();
+PackageStore RepositoryParser::commit_packages(PackageStore packages) {
+	// The Release validators are only kept once its Packages file made it through parsing
+	if (release_validators) {
+		release_validators->second.package_count = unchanged ? package_count : packages.size();
+		ValidatorCache::shared().store(release_validators->first, release_validators->second);
+		release_validators.reset();
 	}
-}
 
-std::string RepositoryParser::fetch_packages_zstd(std::string url) {
-	try {
-		// Write the response data to a file and decompress it
-		std::string file_name = curl_generic_url(url + "/Packages.zst");
-		std::string out_cache_name = ("/tmp/" + file_name + "_decompressed");
+	return packages;
+}
 
-		FILE *const file_in = fopen(("/tmp/" + file_name).c_str(), "rb");
-		FILE *const file_out = fopen(out_cache_name.c_str(), "wb+");
+ReleaseFile RepositoryParser::fetch_release(std::string url) {
+	for (auto name: { "/Release", "/InRelease" }) {
+		std::string release_url = url + name;
+		TraceSpan span("fetch_release", release_url);
+
+		// Every suite of a dist shares its Release file, each keeps its own validators or one suite's 304 would hide another's changes
+		std::string validator_key = repository_key() + "|" + release_url;
+		std::optional<CacheValidators> validators = find_validators(release_url, validator_key);
+
+		try {
+			std::string content;
+			TransferResult result = curl_stream_url(release_url, [&content](std::string_view data) {
+				content.append(data);
+			}, validators ? &*validators : nullptr);
+
+			if (result.status_code == 304) {
+				unchanged = true;
+				package_count = validators->package_count;
+				return ReleaseFile();
+			}
 
-		if (!file_in) {
-			fclose(file_out);
-			throw std::runtime_error(url + ": Failed to open compressed file - ZSTD");
+			release_validators = { validator_key, result.validators };
+			return ReleaseFile::parse(content);
+		} catch (std::exception &exc) {
+			std::cout << exc.what() << std::endl;
 		}
+	}
 
-		if (!file_out) {
-			fclose(file_in);
-			throw std::runtime_error(url + ": Failed to create decompressed file - ZSTD");
-		}
+	return ReleaseFile();
+}
 
-		// Streams don't require a set size, so we use ZSTD's allocated size
-		size_t const buffer_in_size = ZSTD_DStreamInSize();
-		size_t const buffer_out_size = ZSTD_DStreamOutSize();
+std::vector<PackagesCandidate> RepositoryParser::probe_packages(std::string url) {
+	TraceSpan span("probe_packages", url);
+	std::vector<std::pair<PackagesFormat, std::shared_ptr<Transfer>>> probes;
+	std::vector<PackagesCandidate> candidates;
 
-		void *const buffer_in = malloc(buffer_in_size);
-		void *const buffer_out = malloc(buffer_out_size);
+	// Every probe is on the shared engine at once, so they share a connection (or an HTTP/2 stream) to the host
+	for (auto format: packages_formats) {
+		TransferRequest request = build_request(url + "/Packages" + Decompressor::extension(format));
+		request.no_body = true;
+		probes.emplace_back(format, TransferEngine::shared().submit(request));
+	}
 
-		ZSTD_DCtx *const dict_ctx = ZSTD_createDCtx();
-		if (dict_ctx == NULL) {
-			fclose(file_in);
-			free(buffer_in);
-			free(buffer_out);
+	// Probes come back in preference order, so unknown sizes still fall back to that order
+	for (auto &[format, probe]: probes) {
+		std::string chunk;
+		while (probe->read(chunk));
 
-			throw std::runtime_error(url + ": Failed to create ZSTD Dictionary Context");
+		std::string probe_url = url + "/Packages" + Decompressor::extension(format);
+		if (!probe->get_error().empty()) {
+			std::cout << probe_url << ": " << probe->get_error() << std::endl;
+			continue;
 		}
 
-		size_t read_size;
-		size_t last_status = 0;
-		size_t const pending_read = buffer_in_size;
-
-		// We have to basically read every byte at a time and decompress/write it to a buffer
-		while ((read_size = fread(buffer_in, 1, pending_read, file_in))) {
-			ZSTD_inBuffer input = {
-				buffer_in,
-				read_size,
-				0
-			};
-
-			while (input.pos < input.size) {
-				ZSTD_outBuffer output = {
-					buffer_out,
-					buffer_out_size,
-					0
-				};
-
-				size_t const status = ZSTD_decompressStream(dict_ctx, &output, &input);
-				if (ZSTD_isError(status)) {
-					ZSTD_freeDCtx(dict_ctx);
-					fclose(file_in);
-					fclose(file_out);
-					free(buffer_in);
-					free(buffer_out);
-
-					throw std::runtime_error(url + ": ZSTD Decompression error - " + ZSTD_getErrorName(status));
-				}
-
-				fwrite(buffer_out, 1, output.pos, file_out);
-				last_status = status;
-			}
+		if (probe->get_status_code() != 200) {
+			std::cout << probe_url << ": Status Code - " << probe->get_status_code() << std::endl;
+			continue;
 		}
 
-		// If the last status was not okay that means decompression failed somewhere
-		if (last_status != 0) {
-			ZSTD_freeDCtx(dict_ctx);
-			fclose(file_in);
-			fclose(file_out);
-			free(buffer_in);
-			free(buffer_out);
+		// libcurl reports -1 when the server didn't send a Content-Length
+		long long size = probe->get_content_length();
+		candidates.push_back({ format, size < 0 ? 0 : static_cast<size_t>(size), size >= 0 });
+	}
 
-			throw std::runtime_error(url + ": EOF before end of stream - " + ZSTD_getErrorName(last_status));
+	return candidates;
+}
+
+PackageStore RepositoryParser::fetch_packages_stream(std::string url, PackagesFormat format, const ReleaseEntry *expected) {
+	std::string packages_url = url + "/Packages" + Decompressor::extension(format);
+	TraceSpan span("fetch_packages_stream", packages_url);
+	std::optional<CacheValidators> validators = find_validators(packages_url);
+
+	// Download, decompression and parsing all run at once, the raw body is only kept by the download cache
+	PackagePipeline pipeline;
+	std::unique_ptr<Decompressor> decompressor = Decompressor::create(format, [&pipeline](std::string_view data) {
+		pipeline.write(data);
+	});
+
+	// SHA-256 is taken as the bytes arrive (OpenSSL picks SHA-NI/AVX2 itself), there's never a second pass over the body
+	// It's checked against the Release file and doubles as the fingerprint that recognises an identical file
+	Sha256 source_hash;
+	size_t received = 0;
+	double decompress_seconds = 0;
+	auto consume = [&decompressor, &source_hash, &received, &decompress_seconds, expected](std::string_view data) {
+		received += data.size();
+		if (expected != nullptr && received > expected->size) {
+			throw std::runtime_error("Larger than the " + std::to_string(expected->size) + " bytes the Release file lists");
 		}
 
-		ZSTD_freeDCtx(dict_ctx);
-		fclose(file_in);
-		fclose(file_out);
-		free(buffer_in);
-		free(buffer_out);
+		source_hash.update(data);
 
-		std::ifstream cache_file(out_cache_name);
-		if (!cache_file.is_open()) {
-			throw std::runtime_error(url + ": ZSTD cache file not opened");
+		// Includes handing batches to the pipeline, the parsing itself is timed on the pool
+		TraceSpan span("decompress", {}, data.size());
+		MetricTimer timer;
+		decompressor->write(data);
+		decompress_seconds += timer.elapsed();
+	};
+
+	std::unique_ptr<DownloadCache::Writer> cache_writer = DownloadCache::shared().begin(packages_url);
+	TransferResult result = curl_stream_url(packages_url, [&consume, &cache_writer](std::string_view data) {
+		consume(data);
+		if (cache_writer != nullptr) {
+			cache_writer->write(data);
+		}
+	}, validators ? &*validators : nullptr);
+
+	if (result.status_code == 304) {
+		// Same file as last time, so there's nothing to decompress or parse
+		if (RepositorySnapshot::find(repository_key()) != nullptr) {
+			unchanged = true;
+			package_count = validators->package_count;
+			return PackageStore();
 		}
 
-		// Converts our ifstream to a string using streambuf iterators
-		std::string cache_data = std::string((std::istreambuf_iterator<char>(cache_file)), std::istreambuf_iterator<char>());
+		// Nothing in memory to confirm, so the cached copy of the body gets parsed instead
+		cache_writer.reset();
+		try {
+			if (!DownloadCache::shared().read(packages_url, consume)) {
+				ValidatorCache::shared().erase(packages_url);
+				throw std::runtime_error("Not modified, but no longer cached");
+			}
+		} catch (std::exception &exc) {
+			throw std::runtime_error(packages_url + ": " + exc.what());
+		}
 
-		// Delete our cache file and then return
-		std::remove(out_cache_name.c_str());
-		return cache_data;
-	} catch (std::exception &exc) {
-		std::cout << exc.what() << std::endl;
-		return std::string();
+		// Servers aren't required to repeat their validators on a 304
+		if (result.validators.etag.empty() && result.validators.last_modified.empty()) {
+			result.validators = *validators;
+		}
 	}
-}
 
-std::string RepositoryParser::fetch_packages_bzip2(std::string url) {
-	try {
-		// Write the response data to a file and decompress it
-		std::string file_name = curl_generic_url(url + "/Packages.bz2");
-		std::string out_cache_name = ("/tmp/" + file_name + "_decompressed");
+	// A truncated or corrupt download is thrown out here, before any of its packages are committed
+	std::string digest = source_hash.finish();
+	if (expected != nullptr) {
+		if (received != expected->size) {
+			ValidatorCache::shared().erase(packages_url);
+			throw std::runtime_error(packages_url + ": Size mismatch, got " + std::to_string(received) + " bytes but the Release file lists " + std::to_string(expected->size));
+		}
 
-		FILE *const file_in = fopen(("/tmp/" + file_name).c_str(), "rb");
-		FILE *const file_out = fopen(out_cache_name.c_str(), "wb+");
-		char output_buffer[4096];
+		std::string expected_digest = expected->sha256;
+		std::transform(expected_digest.begin(), expected_digest.end(), expected_digest.begin(), [](unsigned char value) {
+			return std::tolower(value);
+		});
 
-		if (!file_in) {
-			fclose(file_out);
-			throw std::runtime_error(url + ": Failed to open compressed file - BZip2");
+		if (!expected_digest.empty() && expected_digest != digest) {
+			ValidatorCache::shared().erase(packages_url);
+			throw std::runtime_error(packages_url + ": SHA-256 mismatch with the Release file");
 		}
+	}
 
-		if (!file_out) {
-			fclose(file_in);
-			throw std::runtime_error(url + ": Failed to create decompressed file - BZip2");
-		}
+	try {
+		TraceSpan span("decompress_finish");
+		MetricTimer timer;
+		decompressor->finish();
+		decompress_seconds += timer.elapsed();
+	} catch (std::exception &exc) {
+		throw std::runtime_error(packages_url + ": " + exc.what());
+	}
 
-		int status = 0;
-		BZFILE *bzip_handle = BZ2_bzReadOpen(&status, file_in, 0, 0, NULL, 0);
+	PackageStore packages = pipeline.finish();
+
+	std::string codec = Decompressor::name(format);
+	std::string host = host_label(this->url);
+	Metrics &metrics = Metrics::shared();
+	metrics.histogram("canister_decompress_seconds", "Time spent decompressing a Packages file", { { "host", host }, { "codec", codec } }).observe(decompress_seconds);
+	metrics.histogram("canister_parse_seconds", "Time spent parsing a Packages file, summed across pool threads", { { "host", host } }).observe(pipeline.parse_seconds());
+	metrics.counter("canister_download_bytes_total", "Compressed Packages bytes downloaded or replayed from the download cache", { { "codec", codec } }).add(received);
+	metrics.counter("canister_decompressed_bytes_total", "Decompressed Packages bytes handed to the parser", { { "codec", codec } }).add(pipeline.bytes_written());
+	source_fingerprint = packages_url + "#" + digest;
+	result.validators.package_count = packages.size();
+	ValidatorCache::shared().store(packages_url, result.validators);
+
+	// Only bodies that parsed all the way through are worth keeping
+	if (cache_writer != nullptr) {
+		cache_writer->commit(digest);
+	}
 
-		if (status != BZ_OK) {
-			BZ2_bzReadClose(&status, bzip_handle);
-			fclose(file_out);
-			fclose(file_in);
+	return packages;
+}
 
-			throw std::runtime_error(url + ": Failed to transfer BZip2 file to BZFILE");
-		}
+TransferResult RepositoryParser::curl_stream_url(std::string url, std::function<void(std::string_view)> callback, const CacheValidators *validators) {
+	TraceSpan span("curl_stream_url", url);
+	TransferResult result;
 
-		do {
-			int read_position = BZ2_bzRead(&status, bzip_handle, output_buffer, sizeof output_buffer);
-			if (status == BZ_OK || status == BZ_STREAM_END) {
-				fwrite(output_buffer, 1, read_position, file_out);
-			}
-		} while (status == BZ_OK);
+	// Validators are only worth sending if we know what the resource parsed to last time
+	if (validators != nullptr && validators->package_count < 0) {
+		validators = nullptr;
+	}
 
-		if (status != BZ_STREAM_END) {
-			BZ2_bzReadClose(&status, &bzip_handle);
-			fclose(file_out);
-			fclose(file_in);
+	std::shared_ptr<Transfer> transfer = TransferEngine::shared().submit(build_request(url, validators));
+	std::string chunk;
 
-			throw std::runtime_error(url + ": EOF before end of stream - " + BZ2_bzerror(&bzip_handle, &status));
+	// The engine thread only downloads, decompression and parsing happen here on the caller
+	while (transfer->read(chunk)) {
+		if (stop_token.stop_requested()) {
+			transfer->cancel();
+			throw std::runtime_error(url + ": Cancelled");
 		}
 
-		fclose(file_out);
-		fclose(file_in);
-
-		std::ifstream cache_file(out_cache_name);
-		if (!cache_file.is_open()) {
-			throw std::runtime_error(url + ": BZip2 cache file not opened");
+		try {
+			callback(chunk);
+		} catch (std::exception &exc) {
+			transfer->cancel();
+			throw std::runtime_error(url + ": " + exc.what());
 		}
 
-		// Converts our ifstream to a string using streambuf iterators
-		std::string cache_data = std::string((std::istreambuf_iterator<char>(cache_file)), std::istreambuf_iterator<char>());
-
-		// Delete our cache file and then return
-		std::remove(out_cache_name.c_str());
-		return cache_data;
-	} catch (std::exception &exc) {
-		std::cout << exc.what() << std::endl;
-		return std::string();
+		result.size += chunk.size();
 	}
-}
 
-std::string RepositoryParser::fetch_packages_normal(std::string url) {
-	try {
-		// Write the response data to a file and decompress it
-		std::string file_name = curl_generic_url(url + "/Packages");
-		std::ifstream cache_file(file_name);
-		if (!cache_file.is_open()) {
-			throw std::runtime_error(url + ": Normal cache file not opened");
-		}
+	result.status_code = transfer->get_status_code();
+	result.timings = transfer->get_timings();
+	result.validators.etag = transfer->get_header("etag");
+	result.validators.last_modified = transfer->get_header("last-modified");
 
-		// Converts our ifstream to a string using streambuf iterators
-		std::string cache_data = std::string((std::istreambuf_iterator<char>(cache_file)), std::istreambuf_iterator<char>());
-		return cache_data;
-	} catch (std::exception &exc) {
-		std::cout << exc.what() << std::endl;
-		return std::string();
+	if (!transfer->get_error().empty()) {
+		throw std::runtime_error(url + ": " + transfer->get_error());
 	}
-}
 
-std::string RepositoryParser::curl_generic_url(std::string url) {
-	try {
-		curlpp::Easy curl_handle;
-		std::ostringstream response_stream;
-
-		// Headers are required for certain repositories (Dynastic)
-		std::list<std::string> headers;
-		headers.push_back("X-Firmware: 2.0");
-		headers.push_back("X-Machine: iPhone13,1");
-		headers.push_back("Cache-Control: no-cache");
-		headers.push_back("X-Unique-ID: canister-v2-unique-device-identifier");
-		std::string user_agent = "Canister/2.0 (+https://canister.me/go/ua)";
-
-		curl_handle.setOpt(curlpp::options::Url(url));
-		curl_handle.setOpt(curlpp::options::Timeout(10));
-		curl_handle.setOpt(curlpp::options::HttpHeader(headers));
-		curl_handle.setOpt(curlpp::options::UserAgent(user_agent));
-		curl_handle.setOpt(curlpp::options::WriteStream(&response_stream));
-		curl_handle.perform();
-
-		// If the status code isn't 200 then we just return a blank string
-		// The blank string is ignored by the individual fetch methods
-		long status_code = curlpp::infos::ResponseCode::get(curl_handle);
-		if (status_code != 200) {
-			throw std::runtime_error(url + ": Status Code - " + std::to_string(status_code));
-		}
+	observe_transfer(host_label(this->url), result.timings);
 
-		std::string response_data = response_stream.str();
-		if (response_data.empty()) {
-			throw std::runtime_error(url + ": Empty response buffer");
-		}
+	// A 304 is only a success if we actually asked for one
+	if (result.status_code == 304 && validators != nullptr) {
+		return result;
+	}
 
-		// We need to normalize filenames for the FS by removing slashes and dots
-		std::string file_name = url.substr(url.find("://") + 3);
-		std::transform(file_name.begin(), file_name.end(), file_name.begin(), [](char value) {
-			if (value == '.' || value == '/') {
-				return '_';
-			}
+	// If the status code isn't 200 then the fetch methods move on to the next format
+	if (result.status_code != 200) {
+		throw std::runtime_error(url + ": Status Code - " + std::to_string(result.status_code));
+	}
 
-			return value;
-		});
+	if (result.size == 0) {
+		throw std::runtime_error(url + ": Empty response buffer");
+	}
 
-		// Here we have to decide if we need to actually update indexes or can exit out early
-		std::ifstream check_file("/tmp/" + file_name);
-		if (check_file.is_open()) {
-			// Converts our ifstream to a string using streambuf iterators
-			std::string cached_data = std::string((std::istreambuf_iterator<char>(check_file)), std::istreambuf_iterator<char>());
+	return result;
+}
 
-			std::vector<unsigned char> cached_hash_vector(picosha2::k_digest_size);
-			picosha2::hash256(cached_data.begin(), cached_data.end(), cached_hash_vector.begin(), cached_hash_vector.end());
-			std::string cached_hash = picosha2::bytes_to_hex_string(cached_hash_vector.begin(), cached_hash_vector.end());
+TransferRequest RepositoryParser::build_request(std::string url, const CacheValidators *validators) {
+	TransferRequest request;
+	request.url = url;
+	request.connect_timeout = 10;
+	request.user_agent = "Canister/2.0 (+https://canister.me/go/ua)";
 
-			std::vector<unsigned char> response_hash_vector(picosha2::k_digest_size);
-			picosha2::hash256(response_data.begin(), response_data.end(), response_hash_vector.begin(), response_hash_vector.end());
-			std::string response_hash = picosha2::bytes_to_hex_string(response_hash_vector.begin(), response_hash_vector.end());
+	// Headers are required for certain repositories (Dynastic)
+	request.headers.push_back("X-Firmware: 2.0");
+	request.headers.push_back("X-Machine: iPhone13,1");
+	request.headers.push_back("X-Unique-ID: canister-v2-unique-device-identifier");
 
-			// Break out early because the repository hasn't changed
-			if (response_hash == cached_hash) {
-				return file_name;
-			}
-		} else {
-			// Write the response data to the file and then return the file name
-			std::ofstream out("/tmp/" + file_name, std::ios::binary | std::ios::out);
-			out << response_data;
-			out.flush();
-			out.close();
-		}
+	// no-cache only makes proxies revalidate with the origin, which still lets the origin answer 304
+	if (Configuration::shared().bypass_proxy_caches) {
+		request.headers.push_back("Cache-Control: no-cache");
+	}
 
-		return file_name;
-	} catch (std::exception &exc) {
-		throw std::runtime_error(exc.what());
+	if (validators != nullptr && !validators->etag.empty()) {
+		request.headers.push_back("If-None-Match: " + validators->etag);
+	}
+
+	if (validators != nullptr && !validators->last_modified.empty()) {
+		request.headers.push_back("If-Modified-Since: " + validators->last_modified);
 	}
+
+	return request;
 }
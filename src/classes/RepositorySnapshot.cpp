@@ -0,0 +1,239 @@
+#include "RepositorySnapshot.hpp"
+#include "Configuration.hpp"
+
+#include <filesystem>
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+
+std::mutex RepositorySnapshot::registry_mutex;
+std::unordered_map<std::string, std::shared_ptr<const RepositorySnapshot>> RepositorySnapshot::registry;
+std::unordered_map<std::string, std::shared_ptr<std::mutex>> RepositorySnapshot::publish_mutexes;
+std::unordered_map<std::string, std::shared_ptr<const RepositorySnapshot>> RepositorySnapshot::baselines;
+
+bool PackageDelta::empty() const {
+	return added.empty() && updated.empty() && removed.empty();
+}
+
+RepositorySnapshot::RepositorySnapshot(PackageStore packages, std::string source_fingerprint) {
+	this->packages = std::move(packages);
+	this->source_fingerprint = source_fingerprint;
+
+	static std::atomic<uint64_t> next_generation = 0;
+	this->generation = ++next_generation;
+}
+
+const std::unordered_map<std::string, std::pair<size_t, uint64_t>> &RepositorySnapshot::get_index() const {
+	std::call_once(index_once, [this]() {
+		index.reserve(packages.size());
+		for (size_t package = 0; package < packages.size(); package++) {
+			// Repositories occasionally list the same package twice, the first one wins like dpkg does
+			index.emplace(identity_key(packages, package), std::make_pair(package, fingerprint(packages, package)));
+		}
+	});
+
+	return index;
+}
+
+const PackageStore &RepositorySnapshot::get_packages() const {
+	return packages;
+}
+
+const std::string &RepositorySnapshot::get_source_fingerprint() const {
+	return source_fingerprint;
+}
+
+uint64_t RepositorySnapshot::get_generation() const {
+	return generation;
+}
+
+PackageDelta RepositorySnapshot::diff(const RepositorySnapshot *previous) const {
+	PackageDelta delta;
+	const auto &index = get_index();
+
+	if (previous == nullptr) {
+		delta.full = true;
+		for (const auto &[key, entry]: index) {
+			delta.added.push_back(entry.first);
+		}
+
+		std::sort(delta.added.begin(), delta.added.end());
+		return delta;
+	}
+
+	const auto &previous_index = previous->get_index();
+	for (const auto &[key, entry]: index) {
+		auto iter = previous_index.find(key);
+		if (iter == previous_index.end()) {
+			delta.added.push_back(entry.first);
+		} else if (iter->second.second != entry.second) {
+			delta.updated.push_back(entry.first);
+		}
+	}
+
+	for (const auto &[key, entry]: previous_index) {
+		if (index.find(key) == index.end()) {
+			const PackageStore &previous_packages = previous->get_packages();
+			delta.removed.push_back({
+				std::string(previous_packages.get(entry.first, PackageField::Package)),
+				std::string(previous_packages.get(entry.first, PackageField::Version)),
+				std::string(previous_packages.get(entry.first, PackageField::Architecture))
+			});
+		}
+	}
+
+	// Keep the order of the Packages file, the maps above don't have one
+	std::sort(delta.added.begin(), delta.added.end());
+	std::sort(delta.updated.begin(), delta.updated.end());
+	return delta;
+}
+
+std::shared_ptr<const RepositorySnapshot> RepositorySnapshot::find(const std::string &repository) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto iter = registry.find(repository);
+	return iter == registry.end() ? nullptr : iter->second;
+}
+
+void RepositorySnapshot::publish(const std::string &repository, std::shared_ptr<const RepositorySnapshot> snapshot, bool unseen) {
+	std::shared_ptr<std::mutex> publish_mutex;
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		std::shared_ptr<std::mutex> &entry = publish_mutexes[repository];
+		if (entry == nullptr) {
+			entry = std::make_shared<std::mutex>();
+		}
+
+		publish_mutex = entry;
+	}
+
+	// A client index and a background refresh of the same repository publish one after the other, never interleaved
+	std::lock_guard<std::mutex> publish_lock(*publish_mutex);
+
+	// Whichever of them parsed last wins, even when it's the first to get here
+	std::shared_ptr<const RepositorySnapshot> published = find(repository);
+	if (published != nullptr && published->generation > snapshot->generation) {
+		return;
+	}
+
+	// Saved before it's visible so the file on disk is never older than what clients have seen
+	try {
+		std::string metadata = repository;
+		metadata.push_back('\0');
+		metadata.append(snapshot->source_fingerprint);
+		snapshot->packages.save(index_path(repository), metadata);
+	} catch (std::exception &exc) {
+		std::cout << exc.what() << std::endl;
+	}
+
+	std::lock_guard<std::mutex> lock(registry_mutex);
+
+	// Later changes pile onto the first baseline, the client gets everything since it last looked in one delta
+	if (unseen) {
+		baselines.emplace(repository, published);
+	}
+
+	registry[repository] = std::move(snapshot);
+}
+
+std::optional<std::pair<std::shared_ptr<const RepositorySnapshot>, std::shared_ptr<const RepositorySnapshot>>> RepositorySnapshot::collect(const std::string &repository) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	auto iter = baselines.find(repository);
+	if (iter == baselines.end()) {
+		return std::nullopt;
+	}
+
+	auto collected = std::make_pair(std::move(iter->second), registry[repository]);
+	baselines.erase(iter);
+	return collected;
+}
+
+void RepositorySnapshot::forget(const std::string &repository) {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	baselines.erase(repository);
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<const RepositorySnapshot>>> RepositorySnapshot::list() {
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	return std::vector<std::pair<std::string, std::shared_ptr<const RepositorySnapshot>>>(registry.begin(), registry.end());
+}
+
+size_t RepositorySnapshot::restore() {
+	std::filesystem::path directory = Configuration::shared().cache_directory + "/snapshots";
+	std::error_code error;
+	size_t restored = 0;
+
+	for (const auto &entry: std::filesystem::directory_iterator(directory, error)) {
+		// Leftovers from saves that were still running when we went down
+		if (entry.path().filename().string().find(".idx.tmp-") != std::string::npos) {
+			std::filesystem::remove(entry.path(), error);
+			continue;
+		}
+
+		if (entry.path().extension() != ".idx") {
+			continue;
+		}
+
+		try {
+			std::string metadata;
+			PackageStore packages = PackageStore::load(entry.path(), metadata);
+
+			size_t separator = metadata.find('\0');
+			if (separator == std::string::npos) {
+				throw std::runtime_error(entry.path().string() + ": Missing repository in index file");
+			}
+
+			std::string repository = metadata.substr(0, separator);
+			auto snapshot = std::make_shared<const RepositorySnapshot>(std::move(packages), metadata.substr(separator + 1));
+
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			registry.emplace(repository, std::move(snapshot));
+			restored++;
+		} catch (std::exception &exc) {
+			// A stale or damaged file only costs us one full crawl of that repository
+			std::cout << exc.what() << std::endl;
+			std::filesystem::remove(entry.path(), error);
+		}
+	}
+
+	return restored;
+}
+
+std::string RepositorySnapshot::index_path(const std::string &repository) {
+	// Repository keys are URLs, so the file is named after a hash of the key instead
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char value: repository) {
+		hash = (hash ^ value) * 1099511628211ULL;
+	}
+
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+	return Configuration::shared().cache_directory + "/snapshots/" + name + ".idx";
+}
+
+std::string RepositorySnapshot::identity_key(const PackageStore &packages, size_t package) {
+	std::string key(packages.get(package, PackageField::Package));
+	key.push_back('\0');
+	key.append(packages.get(package, PackageField::Version));
+	key.push_back('\0');
+	key.append(packages.get(package, PackageField::Architecture));
+	return key;
+}
+
+uint64_t RepositorySnapshot::fingerprint(const PackageStore &packages, size_t package) {
+	// FNV-1a over every key and value, with separators so "ab" + "c" can't collide with "a" + "bc"
+	uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&hash](std::string_view data) {
+		for (unsigned char value: data) {
+			hash = (hash ^ value) * 1099511628211ULL;
+		}
+
+		hash = (hash ^ 0xff) * 1099511628211ULL;
+	};
+
+	packages.for_each_field(package, [&mix](std::string_view key, std::string_view value) {
+		mix(key);
+		mix(value);
+	});
+
+	return hash;
+}
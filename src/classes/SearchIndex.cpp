@@ -0,0 +1,272 @@
+#include "SearchIndex.hpp"
+
+#include <unordered_map>
+#include <algorithm>
+#include <cctype>
+
+// Popular trigrams ("com", "app") sit in nearly every bundle ID, so candidate checks stop somewhere
+static constexpr size_t max_candidates = 20000;
+
+struct SearchIndex::RepositoryIndex {
+	std::shared_ptr<const RepositorySnapshot> snapshot;
+	std::shared_ptr<const RepositoryInfo> info;
+
+	// Lowercased Package and Name of every package, in snapshot order
+	std::vector<std::string> identifiers;
+	std::vector<std::string> names;
+
+	// (lowercased term, package) sorted by term, for prefix lookups
+	std::vector<std::pair<std::string_view, uint32_t>> prefixes;
+
+	std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+	std::unordered_map<std::string, std::vector<uint32_t>> tokens;
+
+	// Lowercased slug and aliases
+	std::vector<std::string> terms;
+};
+
+static std::string lowercase(std::string_view value) {
+	std::string result(value);
+	std::transform(result.begin(), result.end(), result.begin(), [](unsigned char character) {
+		return std::tolower(character);
+	});
+
+	return result;
+}
+
+static uint32_t trigram(std::string_view value, size_t offset) {
+	return static_cast<unsigned char>(value[offset]) << 16 | static_cast<unsigned char>(value[offset + 1]) << 8 | static_cast<unsigned char>(value[offset + 2]);
+}
+
+// Splits on anything that isn't a letter or a digit, single characters are too noisy to be worth indexing
+template <typename Callback>
+static void for_each_token(std::string_view value, Callback callback) {
+	size_t start = 0;
+	while (start < value.size()) {
+		while (start < value.size() && !std::isalnum(static_cast<unsigned char>(value[start]))) {
+			start++;
+		}
+
+		size_t end = start;
+		while (end < value.size() && std::isalnum(static_cast<unsigned char>(value[end]))) {
+			end++;
+		}
+
+		if (end - start > 1) {
+			callback(value.substr(start, end - start));
+		}
+
+		start = end;
+	}
+}
+
+// Posting lists are built in package order, so checking the tail is enough to keep them unique
+static void post(std::vector<uint32_t> &list, uint32_t package) {
+	if (list.empty() || list.back() != package) {
+		list.push_back(package);
+	}
+}
+
+SearchIndex &SearchIndex::shared() {
+	static SearchIndex index;
+	return index;
+}
+
+std::shared_ptr<const SearchIndex::RepositoryIndex> SearchIndex::build(std::shared_ptr<const RepositorySnapshot> snapshot, std::shared_ptr<const RepositoryInfo> info) {
+	auto index = std::make_shared<RepositoryIndex>();
+	const PackageStore &packages = snapshot->get_packages();
+
+	index->identifiers.reserve(packages.size());
+	index->names.reserve(packages.size());
+	for (size_t package = 0; package < packages.size(); package++) {
+		index->identifiers.push_back(lowercase(packages.get(package, PackageField::Package)));
+		index->names.push_back(lowercase(packages.get(package, PackageField::Name)));
+	}
+
+	// Only filled once the strings above stop moving, the prefix table views into them
+	index->prefixes.reserve(packages.size() * 2);
+	for (uint32_t package = 0; package < packages.size(); package++) {
+		for (const std::string *term: { &index->identifiers[package], &index->names[package] }) {
+			if (term->empty()) {
+				continue;
+			}
+
+			index->prefixes.emplace_back(*term, package);
+			for (size_t offset = 0; offset + 3 <= term->size(); offset++) {
+				post(index->trigrams[trigram(*term, offset)], package);
+			}
+		}
+
+		std::string description = lowercase(packages.get(package, PackageField::Description));
+		for_each_token(description, [&index, package](std::string_view token) {
+			post(index->tokens[std::string(token)], package);
+		});
+	}
+
+	std::sort(index->prefixes.begin(), index->prefixes.end());
+
+	index->terms.push_back(lowercase(info->slug));
+	for (const auto &alias: info->aliases) {
+		index->terms.push_back(lowercase(alias));
+	}
+
+	index->snapshot = std::move(snapshot);
+	index->info = std::move(info);
+	return index;
+}
+
+void SearchIndex::update(const std::string &repository, std::shared_ptr<const RepositorySnapshot> snapshot, RepositoryInfo info) {
+	if (snapshot == nullptr) {
+		return;
+	}
+
+	std::shared_ptr<const Generation> current = generation.load();
+	auto iter = current->find(repository);
+	if (iter != current->end() && iter->second->snapshot == snapshot) {
+		const RepositoryInfo &existing = *iter->second->info;
+		if (existing.uri == info.uri && existing.slug == info.slug && existing.aliases == info.aliases && existing.ranking == info.ranking) {
+			return;
+		}
+	}
+
+	// The expensive part happens before taking the lock, so parallel index jobs build in parallel
+	std::shared_ptr<const RepositoryIndex> index = build(std::move(snapshot), std::make_shared<const RepositoryInfo>(std::move(info)));
+
+	std::lock_guard<std::mutex> lock(update_mutex);
+	auto next = std::make_shared<Generation>(*generation.load());
+
+	// Another update of this repository may have finished while we were building, a newer snapshot is never replaced
+	std::shared_ptr<const RepositoryIndex> &installed = (*next)[repository];
+	if (installed != nullptr && installed->snapshot->get_generation() > index->snapshot->get_generation()) {
+		return;
+	}
+
+	installed = std::move(index);
+
+	// Queries still holding the old generation keep it (and its snapshots) alive until they're done
+	generation.store(std::move(next));
+}
+
+void SearchIndex::remove(const std::string &repository) {
+	std::lock_guard<std::mutex> lock(update_mutex);
+	auto next = std::make_shared<Generation>(*generation.load());
+	if (next->erase(repository) > 0) {
+		generation.store(std::move(next));
+	}
+}
+
+size_t SearchIndex::get_repository_count() const {
+	return generation.load()->size();
+}
+
+SearchResults SearchIndex::search(std::string_view query, size_t limit) const {
+	SearchResults results;
+	std::string needle = lowercase(query);
+	if (needle.empty() || limit == 0) {
+		return results;
+	}
+
+	std::vector<std::string> query_tokens;
+	for_each_token(needle, [&query_tokens](std::string_view token) {
+		query_tokens.emplace_back(token);
+	});
+
+	// Candidates stay plain pointers until the cut, only the winners take a reference on their snapshot
+	struct Candidate {
+		const RepositoryIndex *index;
+		uint32_t package;
+		double score;
+	};
+
+	std::shared_ptr<const Generation> current = generation.load();
+	std::unordered_map<uint32_t, double> scores;
+	std::vector<Candidate> candidates;
+
+	for (const auto &[repository, index]: *current) {
+		scores.clear();
+
+		// Exact identifiers beat exact names, which beat prefixes, which beat substrings
+		auto lower = std::lower_bound(index->prefixes.begin(), index->prefixes.end(), std::make_pair(std::string_view(needle), uint32_t(0)));
+		size_t visited = 0;
+		for (auto iter = lower; iter != index->prefixes.end() && iter->first.starts_with(needle) && visited < max_candidates; ++iter, ++visited) {
+			bool identifier = iter->first.data() == index->identifiers[iter->second].data();
+			double score = iter->first.size() == needle.size() ? (identifier ? 100 : 90) : (identifier ? 60 : 50);
+
+			double &current_score = scores[iter->second];
+			current_score = std::max(current_score, score);
+		}
+
+		if (needle.size() >= 3) {
+			// Walk the rarest trigram's list and confirm each candidate really contains the query
+			const std::vector<uint32_t> *rarest = nullptr;
+			for (size_t offset = 0; offset + 3 <= needle.size(); offset++) {
+				auto trigram_iter = index->trigrams.find(trigram(needle, offset));
+				if (trigram_iter == index->trigrams.end()) {
+					rarest = nullptr;
+					break;
+				}
+
+				if (rarest == nullptr || trigram_iter->second.size() < rarest->size()) {
+					rarest = &trigram_iter->second;
+				}
+			}
+
+			if (rarest != nullptr) {
+				size_t checked = std::min(rarest->size(), max_candidates);
+				for (size_t offset = 0; offset < checked; offset++) {
+					uint32_t package = (*rarest)[offset];
+					const std::string &identifier = index->identifiers[package];
+					if (identifier.find(needle) != std::string::npos || index->names[package].find(needle) != std::string::npos) {
+						// The more of the identifier the query covers, the closer the match
+						double &current_score = scores[package];
+						current_score = std::max(current_score, 30.0 + 5.0 * needle.size() / std::max<size_t>(identifier.size(), needle.size()));
+					}
+				}
+			}
+		}
+
+		for (const auto &token: query_tokens) {
+			auto token_iter = index->tokens.find(token);
+			if (token_iter == index->tokens.end()) {
+				continue;
+			}
+
+			for (uint32_t package: token_iter->second) {
+				scores[package] += 10;
+			}
+		}
+
+		// Ranking 1 is the most trusted repository, so its packages win ties against ranking 5
+		double weight = 1 + (5 - std::clamp(index->info->ranking, 1.0, 5.0)) * 0.05;
+		for (const auto &[package, score]: scores) {
+			candidates.push_back({ index.get(), package, score * weight });
+		}
+
+		for (const auto &term: index->terms) {
+			if (!term.empty() && term.starts_with(needle)) {
+				double score = term.size() == needle.size() ? 100 : 50;
+				results.repositories.push_back({ index->info, index->snapshot->get_packages().size(), score * weight });
+				break;
+			}
+		}
+	}
+
+	auto by_score = [](const auto &left, const auto &right) {
+		return left.score > right.score;
+	};
+
+	size_t package_limit = std::min(limit, candidates.size());
+	std::partial_sort(candidates.begin(), candidates.begin() + package_limit, candidates.end(), by_score);
+
+	// The generation keeps every index alive until we return, so the pointers above are still good here
+	for (size_t offset = 0; offset < package_limit; offset++) {
+		const Candidate &candidate = candidates[offset];
+		results.packages.push_back({ candidate.index->snapshot, candidate.index->info, candidate.package, candidate.score });
+	}
+
+	size_t repository_limit = std::min(limit, results.repositories.size());
+	std::partial_sort(results.repositories.begin(), results.repositories.begin() + repository_limit, results.repositories.end(), by_score);
+	results.repositories.resize(repository_limit);
+
+	return results;
+}
@@ -0,0 +1,41 @@
+#include "Sha256.hpp"
+
+#include <stdexcept>
+
+Sha256::Sha256() {
+	context = EVP_MD_CTX_new();
+	if (context == nullptr || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1) {
+		EVP_MD_CTX_free(context);
+		throw std::runtime_error("SHA-256: Failed to initialize digest");
+	}
+}
+
+Sha256::~Sha256() {
+	EVP_MD_CTX_free(context);
+}
+
+void Sha256::update(std::string_view data) {
+	if (EVP_DigestUpdate(context, data.data(), data.size()) != 1) {
+		throw std::runtime_error("SHA-256: Failed to update digest");
+	}
+}
+
+std::string Sha256::finish() {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+
+	if (EVP_DigestFinal_ex(context, digest, &length) != 1) {
+		throw std::runtime_error("SHA-256: Failed to finish digest");
+	}
+
+	static constexpr char hex[] = "0123456789abcdef";
+	std::string result;
+	result.reserve(length * 2);
+
+	for (unsigned int index = 0; index < length; index++) {
+		result.push_back(hex[digest[index] >> 4]);
+		result.push_back(hex[digest[index] & 0x0f]);
+	}
+
+	return result;
+}
@@ -0,0 +1,184 @@
+#include "SocketSession.hpp"
+#include "Configuration.hpp"
+#include "Metrics.hpp"
+#include "Tracing.hpp"
+
+#include <array>
+
+struct SendMetrics {
+	Histogram &encode_seconds;
+	Counter &messages;
+	Counter &bytes;
+};
+
+// Looked up once, send() runs for every message and shouldn't touch the registry lock
+static const SendMetrics &send_metrics(WireFormat format) {
+	auto create = [](WireFormat format) -> SendMetrics {
+		MetricLabels labels = { { "format", WireCodec::name(format) } };
+		Metrics &metrics = Metrics::shared();
+
+		return {
+			metrics.histogram("canister_socket_encode_seconds", "Time spent encoding outgoing socket messages", labels),
+			metrics.counter("canister_socket_messages_total", "Messages queued for websocket clients", labels),
+			metrics.counter("canister_socket_bytes_total", "Encoded bytes queued for websocket clients", labels)
+		};
+	};
+
+	static const std::array<SendMetrics, 3> metrics = {
+		create(WireFormat::Json),
+		create(WireFormat::Cbor),
+		create(WireFormat::MessagePack)
+	};
+
+	return metrics[static_cast<size_t>(format)];
+}
+
+static Gauge &queued_bytes_gauge() {
+	static Gauge &gauge = Metrics::shared().gauge("canister_socket_queued_bytes", "Bytes waiting in session queues across every websocket client");
+	return gauge;
+}
+
+static Gauge &sessions_gauge() {
+	static Gauge &gauge = Metrics::shared().gauge("canister_socket_sessions", "Open websocket sessions");
+	return gauge;
+}
+
+static Histogram &wait_seconds() {
+	static Histogram &histogram = Metrics::shared().histogram("canister_socket_wait_seconds", "Time producers spent parked on socket backpressure");
+	return histogram;
+}
+
+static Histogram &flush_seconds() {
+	static Histogram &histogram = Metrics::shared().histogram("canister_socket_flush_seconds", "Time the event loop spent handing queued messages to the socket");
+	return histogram;
+}
+
+SocketSession::SocketSession(SocketConnection *ws, uWS::Loop *loop) {
+	this->ws = ws;
+	this->loop = loop;
+	this->queue_limit = Configuration::shared().socket_queue_bytes;
+	sessions_gauge().add(1);
+}
+
+void SocketSession::send(nlohmann::json response, WireFormat format) {
+	// Encoding happens on the caller so the event loop only ever copies bytes
+	TraceSpan span("socket_send");
+	const SendMetrics &metrics = send_metrics(format);
+
+	MetricTimer encode_timer;
+	std::string message = WireCodec::encode(response, format);
+	metrics.encode_seconds.observe(encode_timer.elapsed());
+	bool schedule = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (closed.load()) {
+			return;
+		}
+
+		metrics.messages.add();
+		metrics.bytes.add(message.size());
+		queued_bytes_gauge().add(message.size());
+		queued_bytes += message.size();
+		outbound.emplace_back(std::move(message), WireCodec::opcode(format));
+
+		schedule = !flush_scheduled;
+		flush_scheduled = true;
+	}
+
+	// Deferred callbacks run on the loop thread, same as close(), so the socket can't go away under the flush
+	if (schedule) {
+		loop->defer([session = shared_from_this()]() {
+			session->flush();
+		});
+	}
+}
+
+bool SocketSession::is_closed() const {
+	return closed.load();
+}
+
+bool SocketSession::is_backlogged() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return !closed.load() && queued_bytes >= queue_limit;
+}
+
+void SocketSession::when_drained(std::function<void()> callback) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!closed.load() && queued_bytes >= queue_limit) {
+			drain_callbacks.emplace_back(std::move(callback), std::chrono::steady_clock::now());
+			return;
+		}
+	}
+
+	callback();
+}
+
+// Called with the mutex held, callbacks run without it since they're free to send again
+void SocketSession::run_drain_callbacks(std::unique_lock<std::mutex> &lock) {
+	if (drain_callbacks.empty()) {
+		return;
+	}
+
+	auto callbacks = std::move(drain_callbacks);
+	drain_callbacks.clear();
+	lock.unlock();
+
+	auto now = std::chrono::steady_clock::now();
+	for (auto &[callback, parked]: callbacks) {
+		wait_seconds().observe(std::chrono::duration<double>(now - parked).count());
+		callback();
+	}
+
+	lock.lock();
+}
+
+std::stop_token SocketSession::get_stop_token() const {
+	return stop_source.get_token();
+}
+
+void SocketSession::flush() {
+	TraceSpan span("socket_flush");
+	std::unique_lock<std::mutex> lock(mutex);
+	flush_scheduled = false;
+
+	if (closed.load()) {
+		return;
+	}
+
+	// Whatever is left over waits for the drain handler to call us again
+	MetricTimer timer;
+	while (!outbound.empty() && ws->getBufferedAmount() < flush_threshold) {
+		auto [message, opCode] = std::move(outbound.front());
+		outbound.pop_front();
+		queued_bytes -= message.size();
+		queued_bytes_gauge().add(-static_cast<int64_t>(message.size()));
+
+		lock.unlock();
+		ws->send(message, opCode, true);
+		lock.lock();
+	}
+
+	flush_seconds().observe(timer.elapsed());
+	if (queued_bytes < queue_limit) {
+		run_drain_callbacks(lock);
+	}
+}
+
+void SocketSession::close() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (closed.load()) {
+		return;
+	}
+
+	closed.store(true);
+	outbound.clear();
+	queued_bytes_gauge().add(-static_cast<int64_t>(queued_bytes));
+	queued_bytes = 0;
+	sessions_gauge().add(-1);
+
+	// Jobs see the stop first, so parked producers that resume find the session closed and wind down
+	stop_source.request_stop();
+	run_drain_callbacks(lock);
+}
@@ -0,0 +1,171 @@
+#include "StanzaScanner.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CANISTER_SCANNER_X86
+#endif
+
+static constexpr size_t npos = std::string_view::npos;
+
+// A blank line is a newline at p and p + 1, so p never goes past size - 2
+static size_t find_scalar(const char *data, size_t size, size_t from) {
+	while (from + 1 < size) {
+		const char *hit = static_cast<const char *>(std::memchr(data + from, '\n', size - from - 1));
+		if (hit == nullptr) {
+			return npos;
+		}
+
+		size_t position = hit - data;
+		if (data[position + 1] == '\n') {
+			return position;
+		}
+
+		from = position + 1;
+	}
+
+	return npos;
+}
+
+// Only positions below end - 1 are looked at, so the second newline is still inside the buffer
+static size_t rfind_scalar(const char *data, size_t end) {
+	for (size_t position = end; position-- > 1;) {
+		if (data[position] == '\n' && data[position - 1] == '\n') {
+			return position - 1;
+		}
+	}
+
+	return npos;
+}
+
+#ifdef CANISTER_SCANNER_X86
+// Each step compares a block and the same block shifted by one byte, a bit set in both is a blank line
+__attribute__((target("avx2")))
+static size_t find_avx2(const char *data, size_t size, size_t from) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+
+	for (; from + 33 <= size; from += 32) {
+		__m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + from));
+		__m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + from + 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(current, newline), _mm256_cmpeq_epi8(next, newline)));
+		if (mask != 0) {
+			return from + __builtin_ctz(mask);
+		}
+	}
+
+	return find_scalar(data, size, from);
+}
+
+__attribute__((target("avx2")))
+static size_t rfind_avx2(const char *data, size_t end) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+
+	for (; end >= 33; end -= 32) {
+		const char *block = data + end - 33;
+		__m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+		__m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 1));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(current, newline), _mm256_cmpeq_epi8(next, newline)));
+		if (mask != 0) {
+			return end - 33 + 31 - __builtin_clz(mask);
+		}
+	}
+
+	return rfind_scalar(data, end);
+}
+
+static size_t find_sse2(const char *data, size_t size, size_t from) {
+	const __m128i newline = _mm_set1_epi8('\n');
+
+	for (; from + 17 <= size; from += 16) {
+		__m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + from));
+		__m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + from + 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(current, newline), _mm_cmpeq_epi8(next, newline)));
+		if (mask != 0) {
+			return from + __builtin_ctz(mask);
+		}
+	}
+
+	return find_scalar(data, size, from);
+}
+
+static size_t rfind_sse2(const char *data, size_t end) {
+	const __m128i newline = _mm_set1_epi8('\n');
+
+	for (; end >= 17; end -= 16) {
+		const char *block = data + end - 17;
+		__m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+		__m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(current, newline), _mm_cmpeq_epi8(next, newline)));
+		if (mask != 0) {
+			return end - 17 + 31 - __builtin_clz(mask);
+		}
+	}
+
+	return rfind_scalar(data, end);
+}
+#endif
+
+struct ScannerImplementation {
+	const char *name;
+	size_t (*find)(const char *data, size_t size, size_t from);
+	size_t (*rfind)(const char *data, size_t end);
+};
+
+static const ScannerImplementation &scanner() {
+	static const ScannerImplementation implementation = []() -> ScannerImplementation {
+#ifdef CANISTER_SCANNER_X86
+		if (__builtin_cpu_supports("avx2")) {
+			return { "avx2", find_avx2, rfind_avx2 };
+		}
+
+		if (__builtin_cpu_supports("sse2")) {
+			return { "sse2", find_sse2, rfind_sse2 };
+		}
+#endif
+		return { "scalar", find_scalar, rfind_scalar };
+	}();
+
+	return implementation;
+}
+
+size_t StanzaScanner::find_boundary(std::string_view content, size_t from) {
+	if (from >= content.size()) {
+		return npos;
+	}
+
+	return scanner().find(content.data(), content.size(), from);
+}
+
+size_t StanzaScanner::rfind_boundary(std::string_view content) {
+	return scanner().rfind(content.data(), content.size());
+}
+
+std::vector<std::string_view> StanzaScanner::partition(std::string_view content, size_t parts) {
+	std::vector<std::string_view> pieces;
+	parts = std::max<size_t>(parts, 1);
+	size_t start = 0;
+
+	// Every cut is moved forward to the next blank line, a huge stanza just makes its piece bigger
+	for (size_t part = 1; part < parts && start < content.size(); part++) {
+		size_t boundary = find_boundary(content, std::max(start, content.size() / parts * part));
+		if (boundary == npos) {
+			break;
+		}
+
+		pieces.push_back(content.substr(start, boundary + 2 - start));
+		start = boundary + 2;
+	}
+
+	if (start < content.size()) {
+		pieces.push_back(content.substr(start));
+	}
+
+	return pieces;
+}
+
+const char *StanzaScanner::implementation() {
+	return scanner().name;
+}
@@ -0,0 +1,119 @@
+#include "ThreadPool.hpp"
+#include "Configuration.hpp"
+
+// Lets a worker push follow-up tasks onto its own queue instead of a random one
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+ThreadPool::ThreadPool(size_t thread_count) {
+	if (thread_count == 0) {
+		thread_count = 1;
+	}
+
+	for (size_t index = 0; index < thread_count; index++) {
+		workers.push_back(std::make_unique<Worker>());
+	}
+
+	for (size_t index = 0; index < thread_count; index++) {
+		threads.emplace_back(&ThreadPool::run, this, index);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+	}
+
+	sleep_condition.notify_all();
+	for (auto &thread: threads) {
+		thread.join();
+	}
+}
+
+ThreadPool &ThreadPool::shared() {
+	static ThreadPool pool([]() -> size_t {
+		size_t hardware_threads = std::thread::hardware_concurrency();
+		size_t cap = Configuration::shared().worker_threads;
+
+		// Respect the configured cap, but never go beyond the amount of cores we actually have
+		if (cap != 0 && (hardware_threads == 0 || cap < hardware_threads)) {
+			return cap;
+		}
+
+		return hardware_threads == 0 ? 1 : hardware_threads;
+	}());
+
+	return pool;
+}
+
+size_t ThreadPool::size() const {
+	return threads.size();
+}
+
+void ThreadPool::enqueue(std::function<void()> task) {
+	size_t index = current_pool == this ? current_index : next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+
+	{
+		std::lock_guard<std::mutex> lock(workers[index]->mutex);
+		workers[index]->tasks.push_back(std::move(task));
+	}
+
+	// The counter is bumped under the sleep lock so a worker can't miss the wakeup
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		pending_tasks.fetch_add(1, std::memory_order_release);
+	}
+
+	sleep_condition.notify_one();
+}
+
+bool ThreadPool::pop_task(size_t index, std::function<void()> &task) {
+	// Our own queue is worked from the back since those tasks are the most recent (and warm in cache)
+	{
+		std::lock_guard<std::mutex> lock(workers[index]->mutex);
+		if (!workers[index]->tasks.empty()) {
+			task = std::move(workers[index]->tasks.back());
+			workers[index]->tasks.pop_back();
+			pending_tasks.fetch_sub(1, std::memory_order_acq_rel);
+			return true;
+		}
+	}
+
+	// Otherwise steal the oldest task from one of the other workers
+	for (size_t offset = 1; offset < workers.size(); offset++) {
+		Worker &victim = *workers[(index + offset) % workers.size()];
+		std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+
+		if (lock.owns_lock() && !victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			pending_tasks.fetch_sub(1, std::memory_order_acq_rel);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::run(size_t index) {
+	current_pool = this;
+	current_index = index;
+
+	while (true) {
+		std::function<void()> task;
+		if (pop_task(index, task)) {
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleep_condition.wait(lock, [this]() {
+			return stopping || pending_tasks.load(std::memory_order_acquire) > 0;
+		});
+
+		if (stopping && pending_tasks.load(std::memory_order_acquire) == 0) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,154 @@
+#include "Tracing.hpp"
+#include "Configuration.hpp"
+
+#include <filesystem>
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <unistd.h>
+
+static int64_t steady_microseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer &Tracer::shared() {
+	static Tracer tracer;
+	return tracer;
+}
+
+Tracer::Tracer() {
+	epoch = steady_microseconds();
+	capacity = std::max<size_t>(Configuration::shared().trace_events, 1);
+	enabled.store(Configuration::shared().trace_enabled);
+}
+
+void Tracer::set_enabled(bool enabled) {
+	this->enabled.store(enabled);
+}
+
+int64_t Tracer::now() const {
+	return steady_microseconds() - epoch;
+}
+
+Tracer::Buffer &Tracer::local_buffer() {
+	thread_local std::shared_ptr<Buffer> buffer;
+	if (buffer == nullptr) {
+		buffer = std::make_shared<Buffer>();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer->thread = buffers.size() + 1;
+		buffers.push_back(buffer);
+	}
+
+	return *buffer;
+}
+
+void Tracer::record(const char *name, std::string_view detail, int64_t start, int64_t end, int64_t bytes) {
+	Buffer &buffer = local_buffer();
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+
+	// The ring is only allocated by threads that actually trace something
+	if (buffer.events.size() < capacity) {
+		buffer.events.push_back({ name, std::string(detail), start, end - start, bytes });
+		return;
+	}
+
+	// Full, so the oldest span makes room
+	buffer.events[buffer.next] = { name, std::string(detail), start, end - start, bytes };
+	buffer.next = (buffer.next + 1) % capacity;
+	buffer.wrapped = true;
+}
+
+nlohmann::json Tracer::export_trace() {
+	nlohmann::json events = nlohmann::json::array();
+	int pid = getpid();
+
+	std::vector<std::shared_ptr<Buffer>> current;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		current = buffers;
+	}
+
+	for (const auto &buffer: current) {
+		std::vector<TraceEvent> drained;
+		{
+			std::lock_guard<std::mutex> lock(buffer->mutex);
+			drained.swap(buffer->events);
+
+			// Oldest first, so a wrapped ring starts at its write position
+			if (buffer->wrapped) {
+				std::rotate(drained.begin(), drained.begin() + buffer->next, drained.end());
+			}
+
+			buffer->next = 0;
+			buffer->wrapped = false;
+		}
+
+		if (drained.empty()) {
+			continue;
+		}
+
+		events.push_back({
+			{"name", "thread_name"},
+			{"ph", "M"},
+			{"pid", pid},
+			{"tid", buffer->thread},
+			{"args", {{"name", "canister-" + std::to_string(buffer->thread)}}}
+		});
+
+		for (const auto &event: drained) {
+			nlohmann::json object = {
+				{"name", event.name},
+				{"cat", "canister"},
+				{"ph", "X"},
+				{"ts", event.start},
+				{"dur", event.duration},
+				{"pid", pid},
+				{"tid", buffer->thread}
+			};
+
+			if (!event.detail.empty()) {
+				object["args"]["detail"] = event.detail;
+			}
+
+			if (event.bytes >= 0) {
+				object["args"]["bytes"] = event.bytes;
+			}
+
+			events.push_back(std::move(object));
+		}
+	}
+
+	return {
+		{"traceEvents", std::move(events)},
+		{"displayTimeUnit", "ms"}
+	};
+}
+
+TraceDump Tracer::dump() {
+	nlohmann::json trace = export_trace();
+
+	std::string directory = Configuration::shared().cache_directory + "/traces";
+	std::filesystem::create_directories(directory);
+
+	auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::string path = directory + "/trace-" + std::to_string(timestamp) + ".json";
+
+	std::ofstream file(path, std::ios::trunc);
+	file << trace.dump();
+	file.close();
+	if (!file) {
+		throw std::runtime_error(path + ": Failed to write trace");
+	}
+
+	// The thread name entries aren't spans, they don't count
+	size_t events = 0;
+	for (const auto &event: trace["traceEvents"]) {
+		if (event["ph"] == "X") {
+			events++;
+		}
+	}
+
+	return { path, events };
+}
@@ -0,0 +1,332 @@
+#include "TransferEngine.hpp"
+#include "Configuration.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+bool Transfer::read(std::string &chunk) {
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [this]() {
+		return !chunks.empty() || finished;
+	});
+
+	if (chunks.empty()) {
+		return false;
+	}
+
+	chunk = std::move(chunks.front());
+	chunks.pop_front();
+	queued_bytes -= chunk.size();
+
+	// Only resume once there's real room again, otherwise we'd pause and resume on every chunk
+	if (paused && !finished && queued_bytes <= max_queued_bytes / 2) {
+		paused = false;
+		lock.unlock();
+		engine->resume(shared_from_this());
+	}
+
+	return true;
+}
+
+void Transfer::cancel() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (finished || cancelled) {
+			return;
+		}
+
+		cancelled = true;
+		chunks.clear();
+		queued_bytes = 0;
+	}
+
+	engine->cancel(shared_from_this());
+}
+
+long Transfer::get_status_code() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return status_code;
+}
+
+std::string Transfer::get_error() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return error;
+}
+
+long long Transfer::get_content_length() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return content_length;
+}
+
+TransferTimings Transfer::get_timings() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return timings;
+}
+
+std::string Transfer::get_header(const std::string &name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iter = headers.find(name);
+	return iter == headers.end() ? std::string() : iter->second;
+}
+
+size_t Transfer::write_callback(char *data, size_t size, size_t count, void *user_data) {
+	Transfer *transfer = static_cast<Transfer *>(user_data);
+	std::lock_guard<std::mutex> lock(transfer->mutex);
+
+	if (transfer->cancelled) {
+		return 0;
+	}
+
+	// The status code is known by the time the body starts coming in
+	// Anything but a 200 gets aborted here instead of downloading an error page
+	if (transfer->status_code == 0) {
+		curl_easy_getinfo(transfer->handle, CURLINFO_RESPONSE_CODE, &transfer->status_code);
+	}
+
+	if (transfer->status_code != 200) {
+		return 0;
+	}
+
+	// libcurl hands the same data back once we unpause, so nothing is consumed here
+	if (transfer->queued_bytes >= max_queued_bytes) {
+		transfer->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	transfer->chunks.emplace_back(data, size * count);
+	transfer->queued_bytes += size * count;
+	transfer->condition.notify_all();
+	return size * count;
+}
+
+size_t Transfer::header_callback(char *data, size_t size, size_t count, void *user_data) {
+	Transfer *transfer = static_cast<Transfer *>(user_data);
+	std::string_view line(data, size * count);
+	std::lock_guard<std::mutex> lock(transfer->mutex);
+
+	// Redirects send a header block each, only the last one describes the body we get
+	if (line.starts_with("HTTP/")) {
+		transfer->headers.clear();
+		return size * count;
+	}
+
+	size_t separator = line.find(':');
+	if (separator == std::string_view::npos) {
+		return size * count;
+	}
+
+	std::string name(line.substr(0, separator));
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+	std::string_view value = line.substr(separator + 1);
+	size_t value_start = value.find_first_not_of(" \t");
+	size_t value_end = value.find_last_not_of(" \t\r\n");
+	value = value_start == std::string_view::npos ? std::string_view() : value.substr(value_start, value_end - value_start + 1);
+
+	transfer->headers[name] = value;
+	return size * count;
+}
+
+TransferEngine &TransferEngine::shared() {
+	static TransferEngine engine;
+	return engine;
+}
+
+TransferEngine::TransferEngine() {
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	// DNS and TLS sessions are shared on top of the connection cache the multi handle already has
+	share = curl_share_init();
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &TransferEngine::lock_share);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &TransferEngine::unlock_share);
+	curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	Configuration &configuration = Configuration::shared();
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(configuration.max_host_connections));
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(configuration.max_total_connections));
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, static_cast<long>(configuration.max_total_connections));
+
+	thread = std::thread(&TransferEngine::run, this);
+}
+
+TransferEngine::~TransferEngine() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	curl_multi_wakeup(multi);
+	thread.join();
+
+	while (!active.empty()) {
+		complete(active.begin()->first, CURLE_ABORTED_BY_CALLBACK);
+	}
+
+	curl_multi_cleanup(multi);
+	curl_share_cleanup(share);
+}
+
+std::shared_ptr<Transfer> TransferEngine::submit(TransferRequest request) {
+	auto transfer = std::make_shared<Transfer>(this, std::move(request));
+	wake(transfer, incoming);
+	return transfer;
+}
+
+void TransferEngine::resume(std::shared_ptr<Transfer> transfer) {
+	wake(std::move(transfer), resumed);
+}
+
+void TransferEngine::cancel(std::shared_ptr<Transfer> transfer) {
+	wake(std::move(transfer), cancelled);
+}
+
+void TransferEngine::wake(std::shared_ptr<Transfer> transfer, std::vector<std::shared_ptr<Transfer>> &queue) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(std::move(transfer));
+	}
+
+	curl_multi_wakeup(multi);
+}
+
+void TransferEngine::run() {
+	while (true) {
+		std::vector<std::shared_ptr<Transfer>> starting, resuming, cancelling;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping) {
+				return;
+			}
+
+			starting.swap(incoming);
+			resuming.swap(resumed);
+			cancelling.swap(cancelled);
+		}
+
+		for (auto &transfer: starting) {
+			start(transfer);
+		}
+
+		// Unpausing can call the write callback right away, which is fine since we hold no transfer locks
+		for (auto &transfer: resuming) {
+			if (transfer->handle != nullptr && active.count(transfer->handle) > 0) {
+				curl_easy_pause(transfer->handle, CURLPAUSE_CONT);
+			}
+		}
+
+		for (auto &transfer: cancelling) {
+			if (transfer->handle != nullptr && active.count(transfer->handle) > 0) {
+				complete(transfer->handle, CURLE_ABORTED_BY_CALLBACK);
+			}
+		}
+
+		int running_handles = 0;
+		curl_multi_perform(multi, &running_handles);
+
+		int queued_messages = 0;
+		while (CURLMsg *message = curl_multi_info_read(multi, &queued_messages)) {
+			if (message->msg == CURLMSG_DONE) {
+				complete(message->easy_handle, message->data.result);
+			}
+		}
+
+		curl_multi_poll(multi, NULL, 0, 1000, NULL);
+	}
+}
+
+void TransferEngine::start(std::shared_ptr<Transfer> transfer) {
+	CURL *handle = curl_easy_init();
+	transfer->handle = handle;
+
+	for (const auto &header: transfer->request.headers) {
+		transfer->header_list = curl_slist_append(transfer->header_list, header.c_str());
+	}
+
+	curl_easy_setopt(handle, CURLOPT_URL, transfer->request.url.c_str());
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, transfer->header_list);
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, transfer->request.user_agent.c_str());
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, transfer->request.connect_timeout);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, transfer->request.low_speed_limit);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, transfer->request.low_speed_time);
+	curl_easy_setopt(handle, CURLOPT_NOBODY, transfer->request.no_body ? 1L : 0L);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+
+	// Prefer HTTP/2 over TLS and wait for an existing connection to multiplex on instead of opening another
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &Transfer::write_callback);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, transfer.get());
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &Transfer::header_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, transfer.get());
+
+	active[handle] = transfer;
+	curl_multi_add_handle(multi, handle);
+}
+
+void TransferEngine::complete(CURL *handle, CURLcode result) {
+	auto iter = active.find(handle);
+	if (iter == active.end()) {
+		return;
+	}
+
+	std::shared_ptr<Transfer> transfer = iter->second;
+	active.erase(iter);
+
+	{
+		std::lock_guard<std::mutex> lock(transfer->mutex);
+		if (transfer->status_code == 0) {
+			curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &transfer->status_code);
+		}
+
+		curl_off_t content_length = -1;
+		curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+		transfer->content_length = content_length;
+
+		// curl reports every point as an offset from the start, each phase is the gap to the one before
+		curl_off_t name_lookup = 0, connect = 0, app_connect = 0, pre_transfer = 0, start_transfer = 0, total = 0;
+		curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup);
+		curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+		curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &app_connect);
+		curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pre_transfer);
+		curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &start_transfer);
+		curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+
+		TransferTimings &timings = transfer->timings;
+		timings.dns = name_lookup / 1000000.0;
+		timings.connect = std::max<curl_off_t>(connect - name_lookup, 0) / 1000000.0;
+		timings.tls = app_connect > 0 ? std::max<curl_off_t>(app_connect - connect, 0) / 1000000.0 : 0;
+		timings.first_byte = start_transfer > 0 ? std::max<curl_off_t>(start_transfer - pre_transfer, 0) / 1000000.0 : 0;
+		timings.download = start_transfer > 0 ? std::max<curl_off_t>(total - start_transfer, 0) / 1000000.0 : 0;
+		timings.total = total / 1000000.0;
+
+		// Aborting a non-200 body surfaces as a write error, the status code already tells that story
+		bool aborted_error_page = result == CURLE_WRITE_ERROR && transfer->status_code != 200;
+		if (result != CURLE_OK && !aborted_error_page) {
+			transfer->error = curl_easy_strerror(result);
+		}
+
+		transfer->finished = true;
+		transfer->handle = nullptr;
+		transfer->condition.notify_all();
+	}
+
+	curl_multi_remove_handle(multi, handle);
+	curl_easy_cleanup(handle);
+	curl_slist_free_all(transfer->header_list);
+	transfer->header_list = nullptr;
+}
+
+void TransferEngine::lock_share(CURL */*handle*/, curl_lock_data data, curl_lock_access /*access*/, void *user_data) {
+	static_cast<TransferEngine *>(user_data)->share_mutexes[data].lock();
+}
+
+void TransferEngine::unlock_share(CURL */*handle*/, curl_lock_data data, void *user_data) {
+	static_cast<TransferEngine *>(user_data)->share_mutexes[data].unlock();
+}
@@ -0,0 +1,145 @@
+#include "ValidatorCache.hpp"
+#include "Configuration.hpp"
+
+#include <filesystem>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+ValidatorCache &ValidatorCache::shared() {
+	static ValidatorCache cache;
+	return cache;
+}
+
+ValidatorCache::ValidatorCache() {
+	path = Configuration::shared().cache_directory + "/validators";
+	load();
+
+	thread = std::jthread([this](std::stop_token stop_token) {
+		run(stop_token);
+	});
+}
+
+ValidatorCache::~ValidatorCache() {
+	thread.request_stop();
+	thread.join();
+}
+
+std::optional<CacheValidators> ValidatorCache::find(const std::string &url) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iter = entries.find(url);
+	if (iter == entries.end()) {
+		return std::nullopt;
+	}
+
+	return iter->second;
+}
+
+void ValidatorCache::store(const std::string &url, CacheValidators validators) {
+	// Without a validator there's nothing to send next time
+	if (validators.etag.empty() && validators.last_modified.empty()) {
+		erase(url);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[url] = validators;
+		dirty = true;
+	}
+
+	condition.notify_all();
+}
+
+void ValidatorCache::erase(const std::string &url) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (entries.erase(url) == 0) {
+			return;
+		}
+
+		dirty = true;
+	}
+
+	condition.notify_all();
+}
+
+void ValidatorCache::load() {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		return;
+	}
+
+	// One entry per line: url, etag, last modified and package count separated by tabs
+	std::string line;
+	while (std::getline(file, line)) {
+		std::stringstream stream(line);
+		std::string url, etag, last_modified, package_count;
+
+		if (!std::getline(stream, url, '\t') || !std::getline(stream, etag, '\t') || !std::getline(stream, last_modified, '\t') || !std::getline(stream, package_count, '\t')) {
+			continue;
+		}
+
+		try {
+			entries[url] = { etag, last_modified, std::stoi(package_count) };
+		} catch (std::exception &exc) {
+			continue;
+		}
+	}
+}
+
+void ValidatorCache::run(std::stop_token stop_token) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!stop_token.stop_requested()) {
+		condition.wait(lock, stop_token, [this]() {
+			return dirty;
+		});
+
+		// Whatever else a round of indexing stores in the next second goes out in the same write
+		condition.wait_for(lock, stop_token, std::chrono::seconds(1), []() {
+			return false;
+		});
+
+		if (dirty) {
+			save(lock);
+		}
+	}
+
+	// Whatever's left is written before we go down
+	if (dirty) {
+		save(lock);
+	}
+}
+
+// Only the entries are copied under the lock, the file is written without it
+void ValidatorCache::save(std::unique_lock<std::mutex> &lock) {
+	std::string content;
+	for (const auto &[url, validators]: entries) {
+		std::string line = url + "\t" + validators.etag + "\t" + validators.last_modified + "\t" + std::to_string(validators.package_count);
+		if (std::count(line.begin(), line.end(), '\t') != 3 || line.find('\n') != std::string::npos) {
+			continue;
+		}
+
+		content.append(line).append("\n");
+	}
+
+	dirty = false;
+	lock.unlock();
+
+	try {
+		std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+
+		// Written next to the real file and renamed over it, so a crash never leaves half a cache
+		std::string temporary_path = path + ".tmp";
+		std::ofstream file(temporary_path, std::ios::trunc);
+		file << content;
+		file.close();
+		std::filesystem::rename(temporary_path, path);
+	} catch (std::exception &exc) {
+		std::cout << path << ": Failed to save validators - " << exc.what() << std::endl;
+	}
+
+	lock.lock();
+}
@@ -0,0 +1,72 @@
+#include "WireFormat.hpp"
+
+bool WireCodec::detect(std::string_view message, uWS::OpCode opCode, WireFormat &format) {
+	if (opCode == uWS::OpCode::TEXT) {
+		format = WireFormat::Json;
+		return true;
+	}
+
+	if (opCode != uWS::OpCode::BINARY || message.empty()) {
+		return false;
+	}
+
+	unsigned char header = message.front();
+
+	// MessagePack fixmap, map 16 and map 32
+	if ((header >= 0x80 && header <= 0x8f) || header == 0xde || header == 0xdf) {
+		format = WireFormat::MessagePack;
+		return true;
+	}
+
+	// CBOR major type 5 (map), including the indefinite length form
+	if (header >= 0xa0 && header <= 0xbf) {
+		format = WireFormat::Cbor;
+		return true;
+	}
+
+	return false;
+}
+
+nlohmann::json WireCodec::decode(std::string_view message, WireFormat format) {
+	switch (format) {
+		case WireFormat::Cbor:
+			return nlohmann::json::from_cbor(message);
+		case WireFormat::MessagePack:
+			return nlohmann::json::from_msgpack(message);
+		default:
+			return nlohmann::json::parse(message);
+	}
+}
+
+std::string WireCodec::encode(const nlohmann::json &response, WireFormat format) {
+	std::string message;
+
+	switch (format) {
+		case WireFormat::Cbor:
+			nlohmann::json::to_cbor(response, message);
+			break;
+		case WireFormat::MessagePack:
+			nlohmann::json::to_msgpack(response, message);
+			break;
+		default:
+			message = response.dump();
+			break;
+	}
+
+	return message;
+}
+
+uWS::OpCode WireCodec::opcode(WireFormat format) {
+	return format == WireFormat::Json ? uWS::OpCode::TEXT : uWS::OpCode::BINARY;
+}
+
+std::string WireCodec::name(WireFormat format) {
+	switch (format) {
+		case WireFormat::Cbor:
+			return "CBOR";
+		case WireFormat::MessagePack:
+			return "MessagePack";
+		default:
+			return "JSON";
+	}
+}
@@ -0,0 +1,38 @@
+#include "CacheStatsCommand.hpp"
+
+void CacheStatsCommand::execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json /*payload*/) {
+	DownloadCacheStats stats = DownloadCache::shared().get_stats();
+	size_t lookups = stats.hits + stats.misses;
+
+	nlohmann::json response = {
+		{"status", "Cache Statistics"},
+		{"date", date::format("%F %T", std::chrono::system_clock::now())},
+		{"download_cache", {
+			{"hits", stats.hits},
+			{"misses", stats.misses},
+			{"hit_ratio", lookups == 0 ? 0.0 : static_cast<double>(stats.hits) / lookups},
+			{"stores", stats.stores},
+			{"evictions", stats.evictions},
+			{"entries", stats.entries},
+			{"bytes", stats.bytes},
+			{"budget", stats.budget}
+		}}
+	};
+
+	session->send(response, format);
+}
+
+nlohmann::json CacheStatsCommand::schema() {
+	return R"(
+{
+	"$schema": "http://json-schema.org/draft-07/schema#",
+	"$ref": "#/definitions/CacheStatsSchema",
+	"definitions": {
+		"CacheStatsSchema": {
+			"type": "object",
+			"additionalProperties": false
+		}
+	}
+}
+	)"_json;
+}
@@ -1,42 +1,302 @@
 #include "IndexRepoCommand.hpp"
+#include "Configuration.hpp"
+#include "Tracing.hpp"
+
+static nlohmann::json package_json(const PackageStore &packages, size_t package, size_t &bytes) {
+	nlohmann::json object = nlohmann::json::object();
+	packages.for_each_field(package, [&object, &bytes](std::string_view key, std::string_view value) {
+		object[std::string(key)] = value;
+		bytes += key.size() + value.size() + 6;
+	});
+
+	return object;
+}
+
+static nlohmann::json error_response(uint64_t job_id, const nlohmann::json &repository_url, const char *error) {
+	return {
+		{"status", "Error: Repository Failed"},
+		{"date", date::format("%F %T", std::chrono::system_clock::now())},
+		{"job_id", job_id},
+		{"error", error},
+		{"repository_url", repository_url}
+	};
+}
+
+// Package data goes out in bounded chunks ahead of the completion message, never as one giant frame
+// The completion message then only carries the counts
+// A client that falls behind doesn't get to hold a job thread, the stream parks on the session and comes back as a new job
+class DeltaStream: public std::enable_shared_from_this<DeltaStream> {
+public:
+	using Finished = std::function<void(nlohmann::json response)>;
+
+	DeltaStream(std::shared_ptr<SocketSession> session, WireFormat format, const RepositoryParser &parser, uint64_t job_id, nlohmann::json response, double priority, Finished finished) {
+		this->session = session;
+		this->format = format;
+		this->snapshot = parser.get_snapshot();
+		this->repository = parser.repository_key();
+		this->job_id = job_id;
+		this->response = std::move(response);
+		this->priority = priority;
+		this->finished = std::move(finished);
+
+		// Unchanged and failed repositories come back without a snapshot diff at all
+		this->diffed = snapshot != nullptr && !parser.is_unchanged();
+		this->delta = parser.get_delta();
+		this->total = diffed ? delta.added.size() + delta.updated.size() + delta.removed.size() : 0;
+
+		chunk = {
+			{"status", "Repository Packages"},
+			{"job_id", job_id},
+			{"repository_url", this->response["repository_url"]},
+			{"added", nlohmann::json::array()},
+			{"updated", nlohmann::json::array()},
+			{"removed", nlohmann::json::array()}
+		};
+	}
+
+	~DeltaStream() {};
+
+	// Streams until the session is backlogged or closed, or everything went out
+	void run() {
+		TraceSpan span("stream_delta", repository);
+		size_t chunk_bytes = Configuration::shared().socket_chunk_bytes;
+
+		while (position < total && !session->is_closed()) {
+			if (session->is_backlogged()) {
+				park();
+				return;
+			}
+
+			push_next();
+			position++;
+
+			if (bytes >= chunk_bytes) {
+				send_chunk();
+			}
+		}
+
+		if (bytes > 0) {
+			send_chunk();
+		}
+
+		response["delta"] = {
+			{"full", delta.full},
+			{"added", diffed ? delta.added.size() : 0},
+			{"updated", diffed ? delta.updated.size() : 0},
+			{"removed", diffed ? delta.removed.size() : 0},
+			{"chunks", chunks}
+		};
+
+		finished(std::move(response));
+	}
+
+private:
+	std::shared_ptr<SocketSession> session;
+	WireFormat format;
+	std::shared_ptr<const RepositorySnapshot> snapshot;
+	std::string repository;
+	PackageDelta delta;
+	bool diffed;
+	uint64_t job_id;
+	nlohmann::json response;
+	double priority;
+	Finished finished;
+
+	// Position across added, updated and removed, in that order
+	size_t position = 0;
+	size_t total;
+	size_t chunks = 0;
+	size_t bytes = 0;
+	nlohmann::json chunk;
+
+	void push_next() {
+		if (position < delta.added.size()) {
+			chunk["added"].push_back(package_json(snapshot->get_packages(), delta.added[position], bytes));
+			return;
+		}
+
+		size_t updated = position - delta.added.size();
+		if (updated < delta.updated.size()) {
+			chunk["updated"].push_back(package_json(snapshot->get_packages(), delta.updated[updated], bytes));
+			return;
+		}
+
+		const PackageIdentity &identity = delta.removed[updated - delta.updated.size()];
+		bytes += identity.package.size() + identity.version.size() + identity.architecture.size() + 48;
+		chunk["removed"].push_back({
+			{"Package", identity.package},
+			{"Version", identity.version},
+			{"Architecture", identity.architecture}
+		});
+	}
+
+	void send_chunk() {
+		chunk["date"] = date::format("%F %T", std::chrono::system_clock::now());
+		chunk["chunk"] = chunks++;
+		session->send(chunk, format);
+
+		chunk["added"] = nlohmann::json::array();
+		chunk["updated"] = nlohmann::json::array();
+		chunk["removed"] = nlohmann::json::array();
+		bytes = 0;
+	}
+
+	// The drain callback runs on the event loop, so it only queues the rest of the stream
+	// A session that closes meanwhile stops the token and the executor drops the job, nobody is left to tell
+	void park() {
+		session->when_drained([stream = shared_from_this()]() {
+			JobExecutor::shared().submit([stream](std::stop_token) {
+				stream->resume();
+			}, stream->session->get_stop_token(), stream->priority);
+		});
+	}
+
+	void resume() {
+		try {
+			run();
+		} catch (std::exception &exc) {
+			std::cout << repository << ": Streaming failed - " << exc.what() << std::endl;
+			finished(error_response(job_id, response["repository_url"], exc.what()));
+		}
+	}
+};
+
+static RepositoryInfo repository_info(const nlohmann::json &object) {
+	RepositoryInfo info;
+	info.uri = object["uri"].get<std::string>();
+	info.slug = object["slug"].get<std::string>();
+	info.ranking = object["ranking"].get<double>();
+
+	if (object.contains("aliases")) {
+		info.aliases = object["aliases"].get<std::vector<std::string>>();
+	}
+
+	return info;
+}
+
+// A cancelled job says nothing about the repository, only finished ones move its refresh interval
+static void report_refresh(const RepositoryParser &parser, std::stop_token stop_token) {
+	if (!stop_token.stop_requested()) {
+		RefreshScheduler::shared().report(parser.repository_key(), RefreshScheduler::outcome(parser));
+	}
+}
+
+// Indexes one repository of an index_repo payload, its "Repository Completed" reply goes to finished once the delta streamed
+static void index_object(std::shared_ptr<SocketSession> session, WireFormat format, const nlohmann::json &object, uint64_t job_id, std::stop_token stop_token, DeltaStream::Finished finished) {
+	bool distribution = object.contains("dist") && object.contains("suite");
+	std::string uri = object["uri"].get<std::string>();
+	RepositoryParser parser = distribution ? RepositoryParser(uri, object["dist"].get<std::string>(), object["suite"].get<std::string>()) : RepositoryParser(uri);
+	parser.set_stop_token(stop_token);
+
+	int packageCount = parser.index_repository();
+	SearchIndex::shared().update(parser.repository_key(), parser.get_snapshot(), repository_info(object));
+	report_refresh(parser, stop_token);
+
+	// Background refreshes only hold on to what they changed, this client is the one to hear about it
+	// A cancelled job has nobody to tell, so it leaves the changes for the next one
+	if (!stop_token.stop_requested() && parser.collect_changes()) {
+		packageCount = parser.get_snapshot()->get_packages().size();
+	}
+
+	nlohmann::json repository_url = object["uri"];
+	if (distribution) {
+		repository_url = {
+			{"uri", object["uri"]},
+			{"dist", object["dist"]},
+			{"suite", object["suite"]}
+		};
+	}
+
+	nlohmann::json response = {
+		{"status", "Repository Completed"},
+		{"date", date::format("%F %T", std::chrono::system_clock::now())},
+		{"job_id", job_id},
+		{"package_count", packageCount},
+		{"unchanged", parser.is_unchanged()},
+		{"repository_url", repository_url}
+	};
+
+	auto stream = std::make_shared<DeltaStream>(session, format, parser, job_id, std::move(response), object["ranking"].get<double>(), std::move(finished));
+	stream->run();
+}
+
+void IndexRepoCommand::execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) {
+	// The job ID goes out before anything is queued so it always arrives ahead of any progress
+	uint64_t job_id = JobExecutor::next_job_id();
+	nlohmann::json response = {
+		{"status", "Job Queued"},
+		{"date", date::format("%F %T", std::chrono::system_clock::now())},
+		{"job_id", job_id},
+		{"repository_count", payload.size()}
+	};
+
+	session->send(response, format);
+
+	if (payload.empty()) {
+		response["status"] = "Job Completed";
+		session->send(response, format);
+		return;
+	}
+
+	// Everything a client asks for once is kept fresh in the background from then on
+	std::vector<RefreshTarget> targets;
+	for (const auto &object: payload) {
+		bool distribution = object.contains("dist") && object.contains("suite");
+		targets.push_back({
+			object["uri"].get<std::string>(),
+			distribution ? object["dist"].get<std::string>() : "",
+			distribution ? object["suite"].get<std::string>() : "",
+			repository_info(object)
+		});
+	}
+
+	RefreshScheduler::shared().track(targets);
+
+	// Every repository is its own job, whichever finishes last reports the whole batch as done
+	auto completed = std::make_shared<std::atomic<size_t>>(0);
+	size_t total = payload.size();
+
+	// Whatever goes wrong, the repository still gets its reply and still counts towards the batch
+	DeltaStream::Finished finished = [session, format, job_id, completed, total](nlohmann::json response) {
+		size_t finished = completed->fetch_add(1) + 1;
+		response["progress"] = {
+			{"completed", finished},
+			{"total", total}
+		};
+
+		try {
+			session->send(response, format);
+
+			if (finished == total) {
+				nlohmann::json response = {
+					{"status", "Job Completed"},
+					{"date", date::format("%F %T", std::chrono::system_clock::now())},
+					{"job_id", job_id}
+				};
+
+				session->send(response, format);
+			}
+		} catch (std::exception &exc) {
+			std::cout << exc.what() << std::endl;
+		}
+	};
 
-void IndexRepoCommand::execute(uWS::WebSocket<false, true, std::string> *ws, nlohmann::json payload) {
-	// Iterate through all of our repos and decide how we need to construct RepositoryParser
 	for (auto iter = payload.begin(); iter != payload.end(); ++iter) {
 		const auto object = iter.value();
 
-		if (object.contains("dist") && object.contains("suite")) {
-			std::string uri = object["uri"].get<std::string>();
-			std::string dist = object["dist"].get<std::string>();
-			std::string suite = object["suite"].get<std::string>();
-			RepositoryParser parser(uri, dist, suite);
-
-			int packageCount = parser.index_repository();
-			nlohmann::json response = {
-				{"status", "Repository Completed"},
-				{"date", date::format("%F %T", std::chrono::system_clock::now())},
-				{"package_count", packageCount},
-				{"repository_url", {
-					{"uri", object["uri"]},
-					{"dist", object["dist"]},
-					{"suite", object["suite"]}
-				}}
-			};
-
-			ws->send(response.dump(), uWS::OpCode::TEXT, true);
-		} else {
-			std::string uri = object["uri"].get<std::string>();
-			RepositoryParser parser(uri);
-			int packageCount = parser.index_repository();
-			nlohmann::json response = {
-				{"status", "Repository Completed"},
-				{"date", date::format("%F %T", std::chrono::system_clock::now())},
-				{"package_count", packageCount},
-				{"repository_url", object["uri"]}
-			};
-
-			ws->send(response.dump(), uWS::OpCode::TEXT, true);
-		}
+		// Ranking 1 is the best a repository can have, so it's indexed before everything ranked below it
+		double ranking = object["ranking"].get<double>();
+		std::string host = RepositoryParser::host(object["uri"].get<std::string>());
+
+		// Indexing blocks on the network for seconds at a time, so it can't happen on the event loop
+		JobExecutor::shared().submit([session, format, object, job_id, finished](std::stop_token stop_token) {
+			try {
+				index_object(session, format, object, job_id, stop_token, finished);
+			} catch (std::exception &exc) {
+				std::cout << object["uri"].get<std::string>() << ": Index failed - " << exc.what() << std::endl;
+				finished(error_response(job_id, object["uri"], exc.what()));
+			}
+		}, session->get_stop_token(), ranking, host);
 	}
 }
 
@@ -58,6 +318,7 @@ nlohmann::json IndexRepoCommand::schema() {
 						"type": "string"
 					},
 					"ranking": {
+						"description": "Indexing priority, 1 is indexed first and 5 last",
 						"type": "number",
 						"minimum": 1,
 						"maximum": 5
@@ -0,0 +1,95 @@
+#include "SearchCommand.hpp"
+
+// Only what a search result list needs, the full stanza comes with index_repo
+static constexpr PackageField result_fields[] = {
+	PackageField::Package,
+	PackageField::Name,
+	PackageField::Version,
+	PackageField::Architecture,
+	PackageField::Description,
+	PackageField::Section,
+	PackageField::Author,
+	PackageField::Maintainer,
+	PackageField::Icon,
+	PackageField::Depiction
+};
+
+void SearchCommand::execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) {
+	std::string query = payload["query"].get<std::string>();
+	size_t limit = payload.contains("limit") ? payload["limit"].get<size_t>() : 50;
+
+	// Lookups never block on re-indexing, so this is fine to answer right on the event loop
+	SearchResults results = SearchIndex::shared().search(query, limit);
+
+	nlohmann::json packages = nlohmann::json::array();
+	for (const auto &match: results.packages) {
+		const PackageStore &store = match.snapshot->get_packages();
+		nlohmann::json package = {
+			{"score", match.score},
+			{"repository", {
+				{"uri", match.repository->uri},
+				{"slug", match.repository->slug}
+			}}
+		};
+
+		for (auto field: result_fields) {
+			if (store.has(match.package, field)) {
+				package[std::string(PackageStore::field_name(field))] = store.get(match.package, field);
+			}
+		}
+
+		packages.push_back(package);
+	}
+
+	nlohmann::json repositories = nlohmann::json::array();
+	for (const auto &match: results.repositories) {
+		repositories.push_back({
+			{"score", match.score},
+			{"uri", match.repository->uri},
+			{"slug", match.repository->slug},
+			{"aliases", match.repository->aliases},
+			{"ranking", match.repository->ranking},
+			{"package_count", match.package_count}
+		});
+	}
+
+	nlohmann::json response = {
+		{"status", "Search Results"},
+		{"date", date::format("%F %T", std::chrono::system_clock::now())},
+		{"query", query},
+		{"packages", packages},
+		{"repositories", repositories}
+	};
+
+	session->send(response, format);
+}
+
+nlohmann::json SearchCommand::schema() {
+	return R"(
+{
+	"$schema": "http://json-schema.org/draft-07/schema#",
+	"$ref": "#/definitions/SearchSchema",
+	"definitions": {
+		"SearchSchema": {
+			"type": "object",
+			"properties": {
+				"query": {
+					"type": "string",
+					"minLength": 1,
+					"maxLength": 128
+				},
+				"limit": {
+					"type": "integer",
+					"minimum": 1,
+					"maximum": 200
+				}
+			},
+			"additionalProperties": false,
+			"required": [
+				"query"
+			]
+		}
+	}
+}
+	)"_json;
+}
@@ -0,0 +1,62 @@
+#include "TraceCommand.hpp"
+
+void TraceCommand::execute(std::shared_ptr<SocketSession> session, WireFormat format, nlohmann::json payload) {
+	std::string action = payload["action"].get<std::string>();
+	nlohmann::json response = {
+		{"date", date::format("%F %T", std::chrono::system_clock::now())}
+	};
+
+	if (action == "start") {
+		Tracer::shared().set_enabled(true);
+		response["status"] = "Tracing Started";
+	} else if (action == "stop") {
+		Tracer::shared().set_enabled(false);
+		response["status"] = "Tracing Stopped";
+	} else {
+		// Draining every ring and writing the file takes a while, the event loop has other clients to serve
+		// Priority 0 puts it ahead of any index job, tracing itself keeps going if it was on
+		JobExecutor::shared().submit([session, format, response](std::stop_token) mutable {
+			try {
+				TraceDump dump = Tracer::shared().dump();
+				response["status"] = "Trace Dumped";
+				response["path"] = dump.path;
+				response["span_count"] = dump.events;
+			} catch (std::exception &exc) {
+				response["status"] = "Error: Trace Dump Failure";
+				response["error"] = exc.what();
+			}
+
+			response["date"] = date::format("%F %T", std::chrono::system_clock::now());
+			response["enabled"] = Tracer::shared().is_enabled();
+			session->send(response, format);
+		}, session->get_stop_token(), 0);
+
+		return;
+	}
+
+	response["enabled"] = Tracer::shared().is_enabled();
+	session->send(response, format);
+}
+
+nlohmann::json TraceCommand::schema() {
+	return R"(
+{
+	"$schema": "http://json-schema.org/draft-07/schema#",
+	"$ref": "#/definitions/TraceSchema",
+	"definitions": {
+		"TraceSchema": {
+			"type": "object",
+			"properties": {
+				"action": {
+					"type": "string",
+					"enum": ["start", "stop", "dump"],
+					"description": "Start or stop recording spans, or write what was recorded to a Chrome trace file"
+				}
+			},
+			"required": ["action"],
+			"additionalProperties": false
+		}
+	}
+}
+	)"_json;
+}
@@ -5,16 +5,23 @@
 #include <string>
 #include <thread>
 #include <future>
-
-#include "IndexRepoCommand.hpp"
-
-int main() {
-	// All the WebSocket commands
-	std::map<std::string, SocketCommand *> map = {
-		{"index_repo", new IndexRepoCommand()}
-	};
-
-	uWS::App().ws<std::string>("/", {
+#include <vector>
+
+#include "CommandRegistry.hpp"
+#include "RepositorySnapshot.hpp"
+#include "RefreshScheduler.hpp"
+#include "DownloadCache.hpp"
+#include "Configuration.hpp"
+#include "JobExecutor.hpp"
+#include "SearchIndex.hpp"
+#include "Metrics.hpp"
+
+// Runs one App and its event loop on the calling thread until it stops listening
+// Every thread listens on the same port, uSockets sets SO_REUSEPORT so the kernel spreads connections across them
+static void serve(size_t thread) {
+	const CommandRegistry &registry = CommandRegistry::shared();
+
+	uWS::App().ws<SocketData>("/", {
 		.compression = uWS::SHARED_COMPRESSOR,
 		.maxPayloadLength = 16 * 1024 * 1024,
 		.idleTimeout = 36,
@@ -22,6 +29,9 @@ int main() {
 
 		.upgrade = nullptr,
 		.open = [](auto *ws) {
+			// The loop is captured here, on its own thread, so jobs can post back to it later
+			ws->getUserData()->session = std::make_shared<SocketSession>(ws, uWS::Loop::get());
+
 			nlohmann::json response = {
 				{"status", "connected"},
 				{"date", date::format("%F %T", std::chrono::system_clock::now())}
@@ -29,15 +39,26 @@ int main() {
 
 			ws->send(response.dump(), uWS::OpCode::TEXT, true);
 		},
-		.message = [&map](auto *ws, std::string_view message, uWS::OpCode opCode) {
-			// Why would we ever need anything other than text here
-			if (opCode != uWS::OpCode::TEXT) {
+		.message = [&registry](auto *ws, std::string_view message, uWS::OpCode opCode) {
+			std::shared_ptr<SocketSession> session = ws->getUserData()->session;
+
+			// Text frames are JSON, binary frames are CBOR or MessagePack
+			// Replies to this request go out the same way, whatever the client sends in the meantime
+			WireFormat format;
+			if (!WireCodec::detect(message, opCode, format)) {
+				nlohmann::json response = {
+					{"status", "Error: Unrecognized Message Encoding"},
+					{"date", date::format("%F %T", std::chrono::system_clock::now())}
+				};
+
+				// We can't tell what the client speaks, JSON is what every client understands
+				session->send(response, WireFormat::Json);
 				return;
 			}
 
 			try {
-				// Parse our JSON output for commands
-				nlohmann::json data = nlohmann::json::parse(message);
+				// Decode our request in whatever encoding it arrived in
+				nlohmann::json data = WireCodec::decode(message, format);
 
 				// Make sure our command and payload actually exist
 				if (!data.contains("command")) {
@@ -46,7 +67,7 @@ int main() {
 						{"date", date::format("%F %T", std::chrono::system_clock::now())}
 					};
 
-					ws->send(response.dump(), uWS::OpCode::TEXT, true);
+					session->send(response, format);
 					return;
 				}
 
@@ -56,25 +77,25 @@ int main() {
 						{"date", date::format("%F %T", std::chrono::system_clock::now())}
 					};
 
-					ws->send(response.dump(), uWS::OpCode::TEXT, true);
+					session->send(response, format);
 					return;
 				}
 
-				// Let's make sure our command exists in the map first
-				std::string command = data["command"].get<std::string>();
-				if (map.find(command) == map.end()) {
+				// Let's make sure our command exists in the registry first
+				SocketCommand *command = registry.find(data["command"].get<std::string>());
+				if (command == nullptr) {
 					nlohmann::json response = {
 						{"status", "Error: Command not found"},
 						{"date", date::format("%F %T", std::chrono::system_clock::now())}
 					};
 
-					ws->send(response.dump(), uWS::OpCode::TEXT, true);
+					session->send(response, format);
 					return;
 				}
 
 				// Validate the payload before executing
 				try {
-					map[command]->validate(data["payload"]);
+					command->validate(data["payload"]);
 				} catch (std::exception &exc) {
 					nlohmann::json response = {
 						{"status", "Error: Payload Validation Failure"},
@@ -82,13 +103,13 @@ int main() {
 						{"error", exc.what()}
 					};
 
-					ws->send(response.dump(), uWS::OpCode::TEXT, true);
+					session->send(response, format);
 					return;
 				}
 
 				// We can now try to execute our command here
 				try {
-					map[command]->execute(ws, data["payload"]);
+					command->execute(session, format, data["payload"]);
 				} catch (std::exception &exc) {
 					nlohmann::json response = {
 						{"status", "Error: Command Execution Failure"},
@@ -96,18 +117,18 @@ int main() {
 						{"error", exc.what()}
 					};
 
-					ws->send(response.dump(), uWS::OpCode::TEXT, true);
+					session->send(response, format);
 					std::cout << exc.what() << std::endl;
 					return;
 				}
 			} catch (nlohmann::detail::exception &exc) {
 				nlohmann::json response = {
-					{"status", "Error: Invalid JSON"},
+					{"status", "Error: Invalid " + WireCodec::name(format)},
 					{"date", date::format("%F %T", std::chrono::system_clock::now())},
 					{"error", exc.what()}
 				};
 
-				ws->send(response.dump(), uWS::OpCode::TEXT, true);
+				session->send(response, format);
 				return;
 			} catch (std::exception &exc) {
 				std::cout << exc.what() << std::endl;
@@ -115,8 +136,9 @@ int main() {
 				std::cout << "error\n";
 			}
 		},
-		.drain = [](auto */*ws*/) {
-			/* Check getBufferedAmount here */
+		.drain = [](auto *ws) {
+			// uWS flushed some of its buffer, so the session can hand it the next batch of results
+			ws->getUserData()->session->flush();
 		},
 		.ping = [](auto */*ws*/, std::string_view) {
 
@@ -124,12 +146,82 @@ int main() {
 		.pong = [](auto */*ws*/, std::string_view) {
 
 		},
-		.close = [](auto */*ws*/, int /*code*/, std::string_view /*message*/) {
-			/* We automatically unsubscribe from any topic here */
+		.close = [](auto *ws, int /*code*/, std::string_view /*message*/) {
+			// Stops any jobs this client queued and drops whatever they still try to send
+			ws->getUserData()->session->close();
+			ws->getUserData()->session.reset();
 		}
-	}).listen(9000, [](auto *listen_socket) {
+	}).get("/metrics", [](auto *res, auto */*req*/) {
+		// Prometheus text exposition, scraped from the same port as the websocket
+		res->writeStatus("200 OK");
+		res->writeHeader("Content-Type", "text/plain; version=0.0.4");
+		res->end(Metrics::shared().render());
+	}).listen(9000, [thread](auto *listen_socket) {
 		if (listen_socket) {
-			std::cout << "Listening on port " << 9000 << std::endl;
+			std::cout << "Listening on port " << 9000 << " (thread " << thread << ")" << std::endl;
+		} else {
+			std::cout << "Failed to listen on port " << 9000 << " (thread " << thread << ")" << std::endl;
 		}
 	}).run();
 }
+
+int main() {
+	// Commands are registered and compiled before any loop can look one up
+	CommandRegistry::shared();
+
+	size_t threads = Configuration::shared().server_threads;
+	if (threads == 0) {
+		threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	// Whatever was indexed before the last restart is served straight from the mapped index files
+	size_t restored = RepositorySnapshot::restore();
+	std::cout << "Restored " << restored << " repository snapshots" << std::endl;
+
+	// Their search indexes are built in the background, with the slug and aliases the refresh schedule kept for them
+	JobExecutor::shared().submit([](std::stop_token) {
+		for (const auto &[repository, snapshot]: RepositorySnapshot::list()) {
+			std::optional<RepositoryInfo> info = RefreshScheduler::shared().find_info(repository);
+			SearchIndex::shared().update(repository, snapshot, info ? *info : RepositoryInfo { repository.substr(0, repository.find('|')) });
+		}
+	}, std::stop_token());
+
+	RefreshScheduler::shared().start();
+
+	// Values that already live elsewhere are only read when /metrics is scraped
+	Metrics &metrics = Metrics::shared();
+	metrics.callback_gauge("canister_jobs_active", "Index jobs currently running", []() {
+		return JobExecutor::shared().get_active_jobs();
+	});
+
+	metrics.callback_gauge("canister_jobs_queued", "Index jobs waiting for a worker or a host slot", []() {
+		return JobExecutor::shared().get_queued_jobs();
+	});
+
+	metrics.callback_gauge("canister_search_repositories", "Repositories in the search index", []() {
+		return SearchIndex::shared().get_repository_count();
+	});
+
+	metrics.callback_gauge("canister_refresh_tracked", "Repositories kept fresh by the background refresh", []() {
+		return RefreshScheduler::shared().get_tracked_count();
+	});
+
+	metrics.callback_gauge("canister_download_cache_bytes", "Bytes kept by the download cache", []() {
+		return DownloadCache::shared().get_stats().bytes;
+	});
+
+	metrics.callback_gauge("canister_server_threads", "Event loops serving websocket connections", [threads]() {
+		return threads;
+	});
+
+	std::vector<std::thread> servers;
+	for (size_t thread = 1; thread < threads; thread++) {
+		servers.emplace_back(serve, thread);
+	}
+
+	// The main thread runs the first loop itself
+	serve(0);
+	for (auto &server: servers) {
+		server.join();
+	}
+}
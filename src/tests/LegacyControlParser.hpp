@@ -0,0 +1,61 @@
+#pragma once
+
+#include "ControlParser.hpp"
+
+#include <string_view>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <regex>
+#include <map>
+
+// The parser canister-core shipped with before ControlParser, kept as the reference behaviour
+inline std::map<std::string, std::string> legacy_map_package(std::stringstream stream) {
+	std::map<std::string, std::string> control_map;
+	std::string line, previousKey;
+
+	while (std::getline(stream, line, '\n')) {
+		if (line.size() == 0) {
+			continue;
+		}
+
+		std::smatch matches;
+		if (!std::regex_match(line, matches, std::regex("^(.*?): (.*)"))) {
+			size_t end = line.find_last_not_of(' ');
+			end == std::string::npos ? line = "" : line = line.substr(0, end + 1);
+
+			if (!line.ends_with(":")) {
+				control_map[previousKey].append("\n" + line);
+			}
+		}
+
+		if (matches.size() != 3) {
+			continue;
+		}
+
+		control_map.insert(std::make_pair(matches[1], matches[2]));
+		previousKey = matches[1];
+	}
+
+	return control_map;
+}
+
+// How the legacy index loop cut a Packages file into stanzas
+inline void legacy_split(const std::string &content, const std::function<void(std::string)> &callback) {
+	size_t start;
+	size_t end = 0;
+
+	while ((start = content.find_first_not_of("\n\n", end)) != std::string::npos) {
+		end = content.find("\n\n", start);
+		callback(content.substr(start, end - start));
+	}
+}
+
+inline std::map<std::string, std::string> stanza_map(const ControlStanza &stanza) {
+	std::map<std::string, std::string> control_map;
+	for (const auto &field: stanza.fields) {
+		control_map.emplace(field.key, field.value);
+	}
+
+	return control_map;
+}
@@ -0,0 +1,108 @@
+#include "ControlParser.hpp"
+#include "LegacyControlParser.hpp"
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Differential test of ControlParser against the regex parser it replaced
+// Every fixture is split and parsed both ways, any difference in stanzas or fields is a failure
+
+struct Fixture {
+	std::string name;
+	std::string content;
+};
+
+static std::string describe(const std::map<std::string, std::string> &fields) {
+	std::string description;
+	for (const auto &[key, value]: fields) {
+		description += "  [" + key + "] = [" + value + "]\n";
+	}
+
+	return description;
+}
+
+static bool compare(const Fixture &fixture) {
+	std::vector<std::map<std::string, std::string>> expected;
+	legacy_split(fixture.content, [&expected](std::string stanza) {
+		expected.push_back(legacy_map_package(std::stringstream(stanza)));
+	});
+
+	std::vector<std::map<std::string, std::string>> actual;
+	ControlStanza control_stanza;
+	ControlParser::split(fixture.content, [&](std::string_view stanza) {
+		control_stanza.clear();
+		ControlParser::parse(stanza, control_stanza);
+		actual.push_back(stanza_map(control_stanza));
+	});
+
+	if (expected.size() != actual.size()) {
+		std::cout << "FAIL " << fixture.name << ": " << actual.size() << " stanzas, expected " << expected.size() << std::endl;
+		return false;
+	}
+
+	for (size_t index = 0; index < expected.size(); index++) {
+		if (expected[index] != actual[index]) {
+			std::cout << "FAIL " << fixture.name << ": stanza " << index << " differs" << std::endl;
+			std::cout << " expected:\n" << describe(expected[index]) << " actual:\n" << describe(actual[index]);
+			return false;
+		}
+	}
+
+	std::cout << "ok   " << fixture.name << " (" << expected.size() << " stanzas)" << std::endl;
+	return true;
+}
+
+// Stanzas glued together from the pieces real Packages files get wrong, in every order
+static Fixture random_fixture(size_t stanzas, uint64_t seed) {
+	static const char *pieces[] = {
+		"Package: ", "Version", ": ", ":", " ", "  ", "\r", "\t", "a", "b.c", "Depends: x (>= 1)", "Description:"
+	};
+
+	std::mt19937_64 random(seed);
+	std::uniform_int_distribution<size_t> piece(0, std::size(pieces) - 1);
+	std::uniform_int_distribution<size_t> count(0, 6);
+
+	Fixture fixture = { "randomized", "" };
+	for (size_t stanza = 0; stanza < stanzas; stanza++) {
+		for (size_t line = count(random) + 1; line > 0; line--) {
+			for (size_t part = count(random); part > 0; part--) {
+				fixture.content += pieces[piece(random)];
+			}
+
+			fixture.content += "\n";
+		}
+
+		fixture.content += "\n";
+	}
+
+	return fixture;
+}
+
+int main() {
+	std::vector<Fixture> fixtures = {
+		{ "plain", "Package: a\nVersion: 1.0\nArchitecture: all\n\nPackage: b\nVersion: 2.0\n" },
+		{ "crlf", "Package: a\r\nVersion: 1.0\r\nDescription: short\r\n long\r\n\r\nPackage: b\r\n" },
+		{ "crlf_mixed", "Package: a\nVersion: 1.0\r\nDescription: short\n long\r\n" },
+		{ "duplicate_keys", "Package: a\nVersion: 1.0\nVersion: 2.0\n continued\nPackage: b\n" },
+		{ "empty_values", "Package: a\nDepends:\nConflicts: \nSection:   \nVersion: 1.0\n" },
+		{ "empty_value_continuation", "Package: a\nDescription:\n first\n second\n" },
+		{ "continuation_before_key", " orphan\n another\nPackage: a\n" },
+		{ "whitespace_lines", "Package: a\n   \nVersion: 1.0\n \t \nDescription: x\n    \n" },
+		{ "trailing_spaces", "Package: a   \nDescription: short  \n long   \n longer\n" },
+		{ "colon_in_value", "Package: a\nHomepage: https://example.com: 8080\nDescription: key: value\n" },
+		{ "missing_space", "Package:a\nVersion: 1.0\nName:b:\n" },
+		{ "blank_runs", "\n\n\nPackage: a\n\n\n\nPackage: b\n\n\n" },
+		{ "no_trailing_newline", "Package: a\nVersion: 1.0" },
+		{ "empty", "" }
+	};
+
+	fixtures.push_back(random_fixture(20000, 1));
+
+	bool passed = true;
+	for (const auto &fixture: fixtures) {
+		passed = compare(fixture) && passed;
+	}
+
+	return passed ? 0 : 1;
+}